@@ -0,0 +1,40 @@
+/*	$NetBSD$	*/
+
+/*
+ * Interface of est(4): the ioctls of /dev/est and the hooks other
+ * kernel code may call, included as <x86/est.h>.
+ */
+
+#ifndef _X86_EST_H_
+#define _X86_EST_H_
+
+#include <sys/ioccom.h>
+
+/*
+ * Frequency lease, see ESTIOC_LEASE in est(4).
+ */
+struct est_lease {
+	int			el_state;	/* est_fqlist index, -1: none */
+	int			el_ms;		/* duration, out: time left */
+	int			el_throttled;	/* out */
+};
+
+#define ESTIOC_LEASE		_IOWR('E', 0, struct est_lease)
+#define ESTIOC_UNLEASE		_IOR('E', 1, struct est_lease)
+#define ESTIOC_LEASESTAT	_IOR('E', 2, struct est_lease)
+#define ESTIOC_QOS		_IOW('E', 3, int)	/* MHz, 0: withdraw */
+
+#ifdef _KERNEL
+struct est_qos;
+
+/* Also called by firmware (ACPI _PPC) notify handlers. */
+int			est_set_limits(int, int);
+/* Called by input drivers, from any context. */
+void			est_boost(void);
+/* Called by latency-sensitive subsystems; add and update may sleep. */
+struct est_qos		*est_qos_add(int);
+int			est_qos_update(struct est_qos *, int);
+void			est_qos_remove(struct est_qos *);
+#endif /* _KERNEL */
+
+#endif /* _X86_EST_H_ */
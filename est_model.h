@@ -0,0 +1,80 @@
+/*	$NetBSD$	*/
+
+/*
+ * Power model and power budget controller of est(4), kept free of
+ * kernel dependencies so that tools/est_sim can replay load traces
+ * through the same code.  Include <sys/param.h> (kernel) or
+ * <sys/types.h> (userland) first.
+ */
+
+#ifndef _X86_EST_MODEL_H_
+#define _X86_EST_MODEL_H_
+
+#define MSR2FREQINC(msr)	(((int) (msr) >> 8) & 0xff)
+#define MSR2VOLTINC(msr)	((int) (msr) & 0xff)
+
+#define MSR2MHZ(msr, bus)	((MSR2FREQINC((msr)) * (bus) + 50) / 100)
+#define MSR2MV(msr)		(MSR2VOLTINC(msr) * 16 + 700)
+
+/*
+ * Dynamic power P = Ceff * V^2 * f, in mW, of a CPU running the
+ * PERF_CTL value msr, with the effective capacitance in pF.
+ */
+static __inline uint64_t
+est_model_power_mw(uint64_t ceff_pf, uint16_t msr, int bus_clock)
+{
+	uint64_t		mv = MSR2MV(msr);
+
+	return ceff_pf * mv * mv * MSR2MHZ(msr, bus_clock) / 1000000000;
+}
+
+/*
+ * Power budget controller.  cur[c] is the PERF_CTL value CPU c ran
+ * during the last interval and util[c] its busy time, per mille.
+ * *power is set to the power modelled for that interval and the error
+ * against budget (mW) is integrated into *credit, bounded to four
+ * budgets to avoid wind-up.  Returns the index in table[] (fastest
+ * first) of the fastest state whose predicted power for the same work
+ * fits the budget plus the credit.
+ */
+static __inline int
+est_model_pb_select(const uint16_t *table, int nstates, int bus_clock,
+    uint64_t ceff_pf, const uint16_t *cur, const int *util, int ncpu,
+    int budget, int64_t *credit, uint64_t *power)
+{
+	uint64_t		p, u, demand;
+	int64_t			allowed;
+	int			c, i, mhz;
+
+	/* power drawn during the last interval */
+	p = 0;
+	for (c = 0; c < ncpu; c++)
+		p += est_model_power_mw(ceff_pf, cur[c], bus_clock) *
+		    util[c] / 1000;
+	*power = p;
+
+	/* integrate the error, bounded to avoid wind-up */
+	*credit += budget - (int64_t)p;
+	if (*credit > 4 * (int64_t)budget)
+		*credit = 4 * (int64_t)budget;
+	if (*credit < -4 * (int64_t)budget)
+		*credit = -4 * (int64_t)budget;
+	allowed = budget + *credit;
+
+	/* fastest state whose predicted power fits */
+	for (i = 0; i < nstates - 1; i++) {
+		mhz = MSR2MHZ(table[i], bus_clock);
+		p = 0;
+		for (c = 0; c < ncpu; c++) {
+			demand = (uint64_t)util[c] * MSR2MHZ(cur[c], bus_clock);
+			u = demand / mhz < 1000 ? demand / mhz : 1000;
+			p += est_model_power_mw(ceff_pf, table[i], bus_clock) *
+			    u / 1000;
+		}
+		if ((int64_t)p <= allowed)
+			break;
+	}
+	return i;
+}
+
+#endif /* _X86_EST_MODEL_H_ */
@@ -89,15 +89,35 @@ __KERNEL_RCSID(0, "$NetBSD: est.c,v 1.9 2008/04/28 20:23:40 martin Exp $");
 #include <sys/kmem.h>
 #include <sys/sysctl.h>
 #include <sys/once.h>
+#include <sys/mutex.h>
+#include <sys/callout.h>
+#include <sys/workqueue.h>
+#include <sys/xcall.h>
+#include <sys/conf.h>
+#include <sys/select.h>
+#include <sys/event.h>
+#include <sys/atomic.h>
+#include <sys/ioccom.h>
+#include <sys/fcntl.h>
+#include <sys/proc.h>
+#include <sys/device.h>
+
+#include <uvm/uvm_extern.h>
+
+#include <prop/proplib.h>
+
+#include <dev/sysmon/sysmonvar.h>
 
 #include <x86/cpuvar.h>
 #include <x86/cputypes.h>
 #include <x86/cpu_msr.h>
+#include <x86/est.h>
 
 #include <machine/cpu.h>
 #include <machine/specialreg.h>
 
 #include "opt_est.h"
+#include "est_model.h"
 #ifdef EST_FREQ_USERWRITE
 #define	EST_TARGET_CTLFLAG	(CTLFLAG_READWRITE | CTLFLAG_ANYWRITE)
 #else
@@ -989,28 +1009,623 @@ static const struct fqlist est_cpus[] = {
 	ENTRY(IDT, BUS100, eden90_1000)
 };
 
-#define MSR2FREQINC(msr)	(((int) (msr) >> 8) & 0xff)
-#define MSR2VOLTINC(msr)	((int) (msr) & 0xff)
-
-#define MSR2MHZ(msr, bus)	((MSR2FREQINC((msr)) * (bus) + 50) / 100)
-#define MSR2MV(msr)		(MSR2VOLTINC(msr) * 16 + 700)
-
 static const struct 	fqlist *est_fqlist;	/* not NULL if functional */
 static uint16_t		*fake_table;		/* guessed est_cpu table */
 static struct fqlist    fake_fqlist;
 static int 		est_node_target, est_node_current;
+static int		est_node_max, est_node_min;
 static const char 	est_desc[] = "Enhanced SpeedStep";
 static int		lvendor, bus_clock;
+static int		est_node_root;		/* machdep.est */
+
+/*
+ * Allowed window of est_fqlist->table indices.  Index 0 is the highest
+ * frequency, so est_state_max <= est_state_min.  est_lock serializes
+ * updates of the window and every PERF_CTL transition.  est_req_state
+ * is what was last asked for; est_apply() programs it clamped to the
+ * window and the governor caps.
+ */
+static kmutex_t		est_lock;
+static int		est_state_max, est_state_min;
+static int		est_req_state;		/* last requested state */
+
+/*
+ * Coalescing of target writes: when est_coalesce_ms is non-zero a write
+ * only records est_pending_state, and est_coalesce_work applies the
+ * latest one once the window expires.  A direct write, coalesce_ms
+ * going to 0, a lease or another governor end the pending write.
+ */
+static int		est_coalesce_ms;
+static int		est_pending_state = -1;
+static callout_t	est_coalesce_ch;
+static struct workqueue	*est_wq;
+static struct work	est_coalesce_wk;
+static uint64_t		est_stat_coalesced, est_stat_applied;
+
+/*
+ * PERF_CTL is shared by the hyperthreads of a core, so one write per
+ * core is enough.  est_domain_cpu[] holds one CPU per core; it is built
+ * on first use, once the application processors are attached.  Only
+ * CPUs with the same package and core but distinct SMT IDs are grouped;
+ * if two CPUs report the same IDs the topology is unknown (e.g. no
+ * CPUID topology leaves) and every CPU is its own domain.
+ */
+static struct cpu_info	*est_domain_cpu[MAXCPUS];
+static int		est_ndomains, est_domain_ncpu;
+static uint64_t		est_stat_xcalls;
+
+/*
+ * Transition latency: on the first transition, until one is measured,
+ * and then on every EST_TRANS_SAMPLE-th one, each CPU spins after
+ * writing PERF_CTL until PERF_STATUS reports the new value, for at most
+ * EST_TRANS_SPIN_NS of uptime.  The TSC of the Pentium M follows the
+ * core clock, so it cannot time the transition itself.  Transitions
+ * that do not settle in time are not measured, and the spin is not
+ * charged to EST_OV_TRANS.
+ */
+#define EST_TRANS_SPIN_NS	100000
+#define EST_TRANS_SAMPLE	64
+
+static uint64_t		est_trans_ns, est_trans_max;
+static u_int		est_trans_count;
+
+#define EST_EWMA_HIST		16	/* demand history, samples */
+
+/*
+ * Overhead accounting: cycles spent by the driver on each CPU, per
+ * path, with the longest single run.  EST_OV_SAMPLE is the per-CPU
+ * sample cross-call, EST_OV_DECIDE the input updates and governor
+ * decision, EST_OV_TRANS the PERF_CTL cross-call on each CPU and
+ * EST_OV_BCAST est_set_state() as seen by its caller, including the
+ * wait for the cross-calls.
+ */
+#define EST_OV_SAMPLE		0
+#define EST_OV_DECIDE		1
+#define EST_OV_TRANS		2
+#define EST_OV_BCAST		3
+#define EST_OV_N		4
+
+/*
+ * Per-CPU copy of the last PERF_CTL value programmed, so that reading
+ * the target or current frequency is a plain memory load.  PERF_STATUS
+ * is only read when est_current_rdmsr is set.
+ */
+struct est_cpu {
+	uint16_t		ec_perf_ctl;	/* last PERF_CTL written */
+	int			ec_state;	/* its est_fqlist index */
+	uint32_t		ec_therm;	/* sampled THERM_STATUS */
+	uint64_t		ec_cp_time[CPUSTATES];	/* at last sample */
+	int			ec_util;	/* busy, per mille */
+	uint64_t		ec_inst, ec_cycles;	/* PMC at last sample */
+	int			ec_ipc;		/* instr. x100 / cycles, -1 none */
+	uint64_t		ec_sample_ns;	/* uptime at last sample */
+	int			ec_eff_mhz;	/* unhalted cycles per us */
+	int			ec_ewma;	/* smoothed demand, MHz */
+	int			ec_predict;	/* demand expected next */
+	u_int			ec_hist_pos;
+	int			ec_hist[EST_EWMA_HIST];	/* demand, MHz */
+	int			ec_util_delta;	/* util change, per mille */
+	int			ec_nice;	/* niced, per mille of busy */
+	uint64_t		ec_trans_ns;	/* last timed transition, 0: none */
+	u_int			*ec_mca_new;	/* corrected errors per state */
+	int			ec_idle_since;	/* hardclock_ticks, 0: busy */
+	bool			ec_idle_low;	/* at est_idle_state */
+	uint64_t		ec_idle_low_ns;	/* uptime at the drop */
+	uint64_t		ec_idle_time_ns; /* total at the idle state */
+	uint64_t		ec_idle_drops;
+	uint64_t		ec_idle_restores;
+	uint64_t		ec_idle_lat_ns;	/* total restore latency */
+	uint64_t		ec_idle_lat_max;
+	uint64_t		ec_ov[EST_OV_N];	/* cycles, total */
+	uint64_t		ec_ov_max[EST_OV_N];	/* cycles, longest */
+} __aligned(CACHE_LINE_SIZE);
+
+static struct est_cpu	est_cpu[MAXCPUS];
+static int		est_current_rdmsr;
+
+#define EST_CURCPU()	(&est_cpu[cpu_index(curcpu())])
+
+static void		est_ov_account(int, uint64_t);
+
+static const char	*est_ov_names[EST_OV_N] = {
+	"sample", "decide", "transition", "broadcast"
+};
+
+/*
+ * One record per CPU returned by machdep.est.snapshot, filled in by a
+ * single cross-call.  es_state is -1 when PERF_STATUS does not match a
+ * table entry (e.g. during a transition).
+ */
+struct est_snapshot {
+	uint32_t		es_cpu;		/* cpu_index() */
+	uint8_t			es_fid;		/* PERF_STATUS frequency ID */
+	uint8_t			es_vid;		/* PERF_STATUS voltage ID */
+	uint16_t		es_perf_ctl;	/* PERF_CTL FID/VID */
+	uint16_t		es_mhz;
+	uint16_t		es_mv;
+	int16_t			es_state;	/* est_fqlist index */
+} __packed;
+
+/*
+ * /dev/est: EVFILT_READ fires whenever the driver changes P-state or
+ * the phc VID table changes.  kn_fflags tells which one happened and
+ * kn_data counts the changes since the last delivery (use EV_CLEAR).
+ * The major number is allocated dynamically at attach time.
+ */
+#define EST_NOTE_STATE		0x0001	/* PERF_CTL reprogrammed */
+#define EST_NOTE_PHC		0x0002	/* VID table changed */
+
+static struct selinfo	est_sel;
+
+/*
+ * Read-only telemetry mapped by mmap(2) on /dev/est.  Writers hold
+ * est_lock and make es_seq odd while updating; a reader retries until
+ * it sees the same even es_seq before and after its copy.  Times are
+ * nanoseconds of uptime (CLOCK_MONOTONIC); the residency of the current
+ * state is esc_residency[esc_state] + now - esc_entered.  Residency
+ * is kept for the first EST_SHM_MAXSTATES states only, which covers
+ * any table built from a 6-bit VID range; es_nstates is clamped to it.
+ * Time spent at the idle state (est_idle) is counted in the residency
+ * of esc_state and, separately, in esc_idle_ns as of the last update.
+ */
+#define EST_SHM_VERSION		3
+#define EST_SHM_MAXSTATES	64
+
+struct est_shm_cpu {
+	uint32_t		esc_state;	/* est_fqlist index */
+	uint32_t		esc_mhz;
+	uint32_t		esc_mv;
+	uint32_t		esc_idle;	/* at the idle state */
+	uint64_t		esc_transitions;
+	uint64_t		esc_entered;	/* entry in esc_state */
+	uint64_t		esc_idle_ns;	/* total at the idle state */
+	uint64_t		esc_residency[EST_SHM_MAXSTATES];
+};
+
+struct est_shm {
+	volatile uint32_t	es_seq;
+	uint32_t		es_version;
+	uint32_t		es_ncpu;
+	uint32_t		es_nstates;
+	uint64_t		es_applied;
+	uint64_t		es_coalesced;
+	uint64_t		es_xcalls;
+	struct est_shm_cpu	es_cpu[MAXCPUS];
+};
+
+#define EST_SHM_SIZE		round_page(sizeof(struct est_shm))
+
+static struct est_shm	*est_shm;
+
+dev_type_open(estopen);
+dev_type_close(estclose);
+dev_type_ioctl(estioctl);
+dev_type_mmap(estmmap);
+dev_type_kqfilter(estkqfilter);
+
+const struct cdevsw est_cdevsw = {
+	estopen, estclose, noread, nowrite, estioctl,
+	nostop, notty, nopoll, estmmap, estkqfilter, D_OTHER | D_MPSAFE,
+};
+
+static void		est_shm_update(void);
+
+static void		est_notify(long);
+static void		filt_estdetach(struct knote *);
+static int		filt_estevent(struct knote *, long);
+
+static const struct filterops est_filtops =
+	{ 1, NULL, filt_estdetach, filt_estevent };
+
+/*
+ * Dynamic power model P = Ceff * V^2 * f, with the effective switched
+ * capacitance in pF.  The default matches the 24.5 W TDP of a 1.6 GHz
+ * Pentium M at 1.484 V.
+ */
+#define EST_CEFF_PF		7000
+static int		est_ceff_pf = EST_CEFF_PF;
+
+/*
+ * envsys(4) sensors, three per CPU: MHz, core voltage and modelled
+ * power.  They are registered once all CPUs have attached.  Each
+ * refresh reads PERF_STATUS on the CPU, so the sensors show the actual
+ * operating point: throttling, idle drops and transitions in flight.
+ */
+#define EST_SENSOR_MHZ		0
+#define EST_SENSOR_VOLT		1
+#define EST_SENSOR_POWER	2
+#define EST_NSENSORS		3
+
+static struct sysmon_envsys *est_sme;
+static envsys_data_t	*est_sensor;
+static int		est_nsensor;
+
+static uint64_t		est_power_mw(uint16_t);
+static int		est_finalize(device_t);
+static int		est_sensor_init(void);
+static int		est_cpu_sysctl_init(void);
+static void		est_sensor_refresh(struct sysmon_envsys *,
+			    envsys_data_t *);
+static void		est_xc_perf_status(void *, void *);
+
+/*
+ * Governor sampling: while an input is enabled or the governor needs
+ * it, est_sample_ch queues est_sample_wk every est_sample_ms.  Each
+ * sample gathers per-CPU inputs with one cross-call, then adjusts the
+ * caps and asks the governor for a state under est_lock.
+ */
+static int		est_sample_ms = 250;
+static callout_t	est_sample_ch;
+static struct work	est_sample_wk;
+static volatile u_int	est_sample_queued;
+
+/*
+ * Adaptive sampling: with est_adapt_enable the period starts at
+ * est_sample_ms and doubles, up to est_sample_max_ms, while the state
+ * stays put or all CPUs are idle.  A load change of EST_ADAPT_DELTA
+ * drops it back to the floor, a state change alone halves it.  The
+ * floor is est_sample_min_ms, but never less than EST_ADAPT_TRANS
+ * times the measured transition latency.
+ */
+#define EST_ADAPT_DELTA		100	/* per mille */
+#define EST_ADAPT_IDLE		50	/* per mille */
+#define EST_ADAPT_TRANS		100
+#define EST_WAKE_WINDOW		10	/* seconds */
+
+static int		est_adapt_enable = 1;
+static int		est_sample_min_ms = 10;
+static int		est_sample_max_ms = 2000;
+static int		est_sample_cur_ms = 250;
+
+/* callout wakeups caused by the governor, and their rate x100 */
+static volatile uint64_t est_stat_wakeups;
+static uint64_t		est_wake_n0;
+static int		est_wake_t0, est_wake_rate;
+
+/*
+ * Governors pick est_req_state.  eg_sample runs on every CPU from the
+ * sample cross-call; eg_select_state runs under est_lock and returns
+ * the state to request, or -1 to keep the current request.  eg_init
+ * and eg_teardown run under est_lock when the governor is selected or
+ * replaced.  "userspace", the default, has no hooks: the state is the
+ * one written to machdep.est.frequency.target.  Governors are looked
+ * up by name through machdep.est.governor.current.
+ */
+struct est_governor {
+	const char		*eg_name;
+	int			(*eg_init)(void);
+	void			(*eg_sample)(struct est_cpu *);
+	int			(*eg_select_state)(void);
+	void			(*eg_teardown)(void);
+	LIST_ENTRY(est_governor) eg_list;
+};
+
+#define EST_GOV_NAMELEN		16
+
+static LIST_HEAD(, est_governor) est_governors =
+    LIST_HEAD_INITIALIZER(est_governors);
+static struct est_governor *est_gov;
+static int		est_node_gov_current;
+
+static int		est_governor_register(struct est_governor *);
+static int		est_governor_select(const char *);
+static int		est_sysctl_govname(SYSCTLFN_PROTO);
+
+/*
+ * Thermal input: step the cap down one state while a CPU is within
+ * est_therm_margin degrees of TjMax (or signals PROCHOT on parts
+ * without a digital readout) and back up once every CPU has stayed
+ * est_therm_hyst degrees cooler for est_therm_holdoff samples.
+ */
+#define THERM_STATUS_HOT	0x00000001	/* PROCHOT asserted */
+#define THERM_STATUS_READOUT(s)	(((s) >> 16) & 0x7f)	/* below TjMax */
+#define THERM_STATUS_VALID	0x80000000
+
+static int		est_therm_enable;
+static int		est_therm_margin = 5;
+static int		est_therm_hyst = 5;
+static int		est_therm_holdoff = 4;
+static int		est_therm_state;	/* cap, est_fqlist index */
+static int		est_therm_cool;
+static uint64_t		est_stat_therm_down, est_stat_therm_up;
+
+/*
+ * Power budget controller ("powerbudget"): while est_pb_budget (mW) is
+ * non-zero, pick each sample the fastest state whose modelled power,
+ * given the work observed on every CPU, fits the budget plus the
+ * accumulated error est_pb_credit, so that the state mix averages out
+ * at the budget.
+ */
+static int		est_pb_budget;
+static int		est_pb_power;		/* last modelled mW */
+static int64_t		est_pb_credit;
+
+static int		est_pb_init(void);
+static int		est_pb_select(void);
+
+/*
+ * Memory-bound phase detection: with est_pmc_enable set, the first two
+ * performance counters count instructions retired and unhalted cycles.
+ * Only the P6 PMU (Pentium Pro to Pentium M) is driven: there EN in
+ * PERFEVTSEL0 starts both counters, while on CPUs with architectural
+ * performance monitoring (CPUID leaf 0x0a) each counter has its own
+ * enable and counter 1 would never run.  A CPU whose cycle counter did
+ * not move has no IPC and does not vote.  While every busy CPU retires
+ * fewer than est_ipc_threshold instructions per 100 cycles the cap moves
+ * down one state; it moves back up once a busy CPU exceeds the threshold
+ * by est_ipc_hyst.  A zero threshold, the default, only measures, so
+ * enabling the counters for effective_mhz does not cap the state; 50
+ * is a reasonable threshold for the cap.  This claims the counters
+ * from other PMC users.
+ *
+ * The same counters give the effective frequency of each CPU: unhalted
+ * cycles per microsecond the CPU was busy (ec_util) over the last
+ * sample.  Idle time is left out, so it only falls below the programmed
+ * frequency when the clock is throttled (TM1/TM2 or clock modulation).
+ * It reads 0 while the counters are off or the CPU was idle.
+ */
+#define EST_PMC_INST_RETIRED	0xc0
+#define EST_PMC_CLK_UNHALTED	0x79
+#define EST_PMC_USR		0x00010000
+#define EST_PMC_OS		0x00020000
+#define EST_PMC_EN		0x00400000
+#define EST_PMC_MASK		0xffffffffffULL	/* 40-bit counters */
+#define EST_BUSY		100	/* per mille */
+
+static int		est_pmc_enable;
+static int		est_ipc_threshold;	/* 0: measure only */
+static int		est_ipc_hyst = 20;
+static int		est_ipc_state;		/* cap, est_fqlist index */
+static int		est_ipc_last;		/* lowest busy CPU IPC x100 */
+static uint64_t		est_stat_ipc_down, est_stat_ipc_up;
+
+/*
+ * Predictive governor ("predictive"): each CPU keeps an exponentially
+ * weighted average of its demand (utilisation times MHz) with weight
+ * est_ewma_alpha percent for the newest sample.  With est_ewma_period
+ * set, the demand history is also searched for a repeating pattern;
+ * when one matches closely the value one period back is used as the
+ * prediction instead.  The slowest state that serves the highest
+ * predicted demand at EST_EWMA_LOAD percent load is selected.
+ */
+#define EST_EWMA_LOAD		80
+
+static int		est_ewma_alpha = 30;
+static int		est_ewma_period;
+
+static int		est_ewma_init(void);
+static void		est_ewma_sample(struct est_cpu *);
+static int		est_ewma_periodic(struct est_cpu *);
+static int		est_ewma_select(void);
+
+/*
+ * Run queue input: with est_runq_enable set, threads found waiting in
+ * a run queue raise the floor to the top state, without waiting for the
+ * utilisation to catch up.  The run queue is private to kern_runq.c, so
+ * est_runq_ch probes it with sched_curcpu_runnable_p() from softclock,
+ * where the interrupted LWP is not on the queue (in the sampling
+ * cross-call it always would be), on the CPU the callout runs on.
+ * While the floor is down the probe runs every est_runq_probe_ms, but
+ * only as long as the last sample found a busy CPU; with the floor up,
+ * each sample arms one probe, which drops the floor if nothing waits.
+ */
+static int		est_runq_enable;
+static int		est_runq_probe_ms = 10;
+static int		est_runq_floor;		/* floor, est_fqlist index */
+static bool		est_runq_busy;		/* a CPU was busy */
+static callout_t	est_runq_ch;
+static struct work	est_runq_wk;
+static volatile u_int	est_runq_queued;
+static volatile int	est_runq_want;		/* floor for est_runq_wk */
+static uint64_t		est_stat_runq_boosts;
+
+static void		est_runq_tick(void *);
+static void		est_runq_work(void);
+
+/*
+ * Nice input: with est_nice_enable set, the state is capped at
+ * est_nice_mhz while every busy CPU spent at least est_nice_share
+ * percent of its busy time in niced processes, so that background
+ * jobs do not drive the clock up.  Any CPU busy with normal or
+ * realtime work lifts the cap at the next sample.
+ */
+static int		est_nice_enable;
+static int		est_nice_mhz;		/* 0: lowest state */
+static int		est_nice_share = 90;
+static int		est_nice_target;	/* est_nice_mhz, as an index */
+static int		est_nice_state;		/* cap, est_fqlist index */
+static uint64_t		est_stat_nice_caps;
+
+static void		est_nice_update(void);
+
+/*
+ * Interactive boost: est_boost() raises the floor to est_boost_state
+ * for est_boost_ms, at most once every est_boost_interval_ms.  It can
+ * be called from interrupt context; the transition itself is done by
+ * est_boost_wk, which also drops the floor once the boost expires.
+ */
+static int		est_boost_enable;
+static int		est_boost_mhz;		/* 0: highest state */
+static int		est_boost_ms = 100;
+static int		est_boost_interval_ms = 50;
+static int		est_boost_state;
+static int		est_boost_floor;	/* floor, est_fqlist index */
+static volatile int	est_boost_last;		/* hardclock_ticks */
+static callout_t	est_boost_ch;
+static struct work	est_boost_wk;
+static volatile u_int	est_boost_queued;
+static volatile uint64_t est_stat_boosts, est_stat_boosts_limited;
+
+static void		est_boost_tick(void *);
+static void		est_boost_work(void);
+
+/*
+ * Frequency lease: ESTIOC_LEASE on /dev/est pins every CPU to table
+ * entry el_state for el_ms milliseconds, for reproducible benchmarks.
+ * Meanwhile target writes and governor changes fail with EBUSY, the
+ * governor is not consulted and the idle hook stays off; only the
+ * frequency limits and the thermal cap still apply.  el_state is
+ * clamped to the limits, and ESTIOC_LEASE and ESTIOC_LEASESTAT report
+ * the state the limits leave.  The lease ends on
+ * ESTIOC_UNLEASE, on expiry, when the holder exits or when /dev/est
+ * is last closed.  el_throttled tells whether the CPUs were throttled
+ * during the lease, by the thermal cap or by the hardware (the
+ * THERM_STATUS log bit).  The holder may renew its lease.  struct
+ * est_lease and the ioctls are in <x86/est.h>.
+ */
+#define EST_LEASE_MAX_MS	(60 * 60 * 1000)
+#define THERM_STATUS_LOG	0x00000002	/* sticky, write 0 to clear */
+
+static int		est_lease_state = -1;	/* est_fqlist index */
+static struct proc	*est_lease_proc;
+static int		est_lease_end;		/* hardclock_ticks */
+static bool		est_lease_capped;	/* by the thermal cap */
+static bool		est_lease_throttled;	/* result of the last lease */
+static callout_t	est_lease_ch;
+static struct work	est_lease_wk;
+static volatile u_int	est_lease_queued;
+static void		*est_exithook;
+
+static void		est_lease_tick(void *);
+static void		est_lease_work(void);
+static void		est_lease_release(void);
+static void		est_lease_stat(struct est_lease *);
+static void		est_xc_therm_log(void *, void *);
+static void		est_proc_exit(struct proc *, void *);
+
+/*
+ * Minimum-frequency QoS requests, from kernel code through
+ * est_qos_add() or from a process through ESTIOC_QOS on /dev/est (one
+ * request per process, 0 MHz withdraws it).  The fastest request is a
+ * floor honoured by target writes and governors alike; the limits and
+ * the caps still win.  Process requests go away when the process
+ * exits or /dev/est is last closed.
+ */
+struct est_qos {
+	int			eq_state;	/* est_fqlist index */
+	struct proc		*eq_proc;	/* NULL: kernel request */
+	LIST_ENTRY(est_qos)	eq_list;
+};
+
+static LIST_HEAD(, est_qos) est_qos_list =
+    LIST_HEAD_INITIALIZER(est_qos_list);
+static int		est_qos_floor;		/* floor, est_fqlist index */
+static int		est_qos_mhz;		/* 0: no request */
+static int		est_qos_nreq;
+
+static void		est_qos_recalc(void);
+static int		est_qos_proc(struct proc *, int);
+
+/*
+ * Idle coupling: with est_idle_enable set, est_idle() wraps the x86
+ * idle routine.  Once a CPU has been idle for est_idle_ms it programs
+ * its own PERF_CTL to est_idle_state, and it restores the state last
+ * programmed by the driver as soon as a thread becomes runnable.  Only
+ * used when no two CPUs share a PERF_CTL.  Runs in the idle loop, so
+ * it only touches its own est_cpu entry and never takes est_lock: the
+ * drop leaves ec_perf_ctl and ec_state alone, and the time spent at
+ * the idle state is kept apart in ec_idle_time_ns, which the telemetry
+ * page picks up at its next update.
+ *
+ * The "racetoidle" governor uses the same hook (est_race_enable): busy
+ * CPUs run at the highest allowed state and drop to the lowest one on
+ * idle entry.
+ */
+static int		est_race_enable;
+static int		est_idle_enable;
+static int		est_idle_ms = 20;
+static int		est_idle_mhz;		/* 0: lowest state */
+static int		est_idle_state;
+static void		(*est_idle_prev)(void);
+static bool		est_idle_installed;
+
+static void		est_idle(void);
+static void		est_idle_hook(bool);
+static int		est_idle_check(void);
+static int		est_race_init(void);
+static int		est_race_select(void);
+static void		est_race_teardown(void);
+
+static struct est_governor est_gov_userspace = {
+	"userspace", NULL, NULL, NULL, NULL
+};
+static struct est_governor est_gov_powerbudget = {
+	"powerbudget", est_pb_init, NULL, est_pb_select, NULL
+};
+static struct est_governor est_gov_predictive = {
+	"predictive", est_ewma_init, est_ewma_sample, est_ewma_select, NULL
+};
+static struct est_governor est_gov_racetoidle = {
+	"racetoidle", est_race_init, NULL, est_race_select, est_race_teardown
+};
+static int		est_sysctl_cpusum(SYSCTLFN_PROTO);
+
+static void		est_apply(void);
+static void		est_work(struct work *, void *);
+static bool		est_sample_active(void);
+static void		est_sample_schedule(void);
+static void		est_sample_tick(void *);
+static void		est_sample(void);
+static void		est_adapt(int);
+static void		est_wake_update(void);
+static void		est_xc_sample(void *, void *);
+static void		est_therm_update(void);
+static bool		est_pmc_p6(void);
+static void		est_xc_pmc(void *, void *);
+static void		est_ipc_update(void);
+static void		est_runq_update(void);
+static int		est_sysctl_governor(SYSCTLFN_PROTO);
 
 static int		est_sysctl_helper(SYSCTLFN_PROTO);
+static int		est_sysctl_snapshot(SYSCTLFN_PROTO);
+static void		est_xc_snapshot(void *, void *);
 static int		est_init_once(void);
 static void		est_init_main(int);
+static int		est_freq_to_state(int);
+static int		est_floor_state(void);
+static int		est_lease_clamp(int);
+static int		est_clamp_state(int);
+static void		est_set_state(int);
+static void		est_domain_init(void);
+static void		est_xc_perf_ctl(void *, void *);
+static int		est_update_limits(int, int);
+static void		est_coalesce_tick(void *);
+static void		est_coalesce_work(void);
+static void		est_coalesce_stop(bool);
+static int		est_sysctl_coalesce(SYSCTLFN_PROTO);
 
 #define PHC_ID16(FID, VID)	( ((FID) << 8) | (VID) )
 #define PHC_MAXLEN		30
 static uint16_t*	phc_origin_table;	/* PHC: keep orignal settings */
 static char		*phc_string_vids;
 static int		phc_est_sysctl_helper(SYSCTLFN_PROTO);
+static int		phc_parse_vids(char *, int *);
+static void		phc_set_vids(const int *);
+static void		phc_vids_string(void);
+static void		phc_boot_vids(void);
+static bool		phc_boot_applied;	/* APs still on stock VIDs */
+
+/*
+ * PHC: machine-check guard.  With phc_mca_enable set, the sample
+ * cross-call and every PERF_CTL cross-call, just before the write,
+ * poll the MCA banks for corrected errors.  Errors are charged to the
+ * state the CPU was running (ec_state is only updated once the
+ * transition is done) in ec_mca_new, and at the next sample the VIDs
+ * of the states hit are raised one step, never above the original.
+ */
+#define MCI_STATUS_VAL		0x8000000000000000ULL
+#define MCI_STATUS_UC		0x2000000000000000ULL
+#define PHC_MCA_MAXBANKS	32
+
+static int		phc_mca_enable;
+static int		phc_mca_nbanks;
+static uint64_t		*phc_mca_errors;	/* per est_fqlist state */
+static bool		*phc_mca_hit;
+static u_int		*phc_mca_new;		/* backs est_cpu[].ec_mca_new */
+
+static void		phc_mca_poll(struct est_cpu *);
+static void		phc_mca_update(void);
+static int		phc_mca_sysctl_errors(SYSCTLFN_PROTO);
 
 /* atoi clone:
  * parse a string, discarding no-digit character
@@ -1046,9 +1661,7 @@ phc_est_sysctl_helper(SYSCTLFN_ARGS)
 	struct sysctlnode	node;
 	int			error;
 	char			input_string[PHC_MAXLEN];
-	struct msr_cpu_broadcast mcb;
-	int			i,fq,*vids;
-	char			*string,*remain;
+	int			*vids;
 
 	if (est_fqlist == NULL)
 		return EOPNOTSUPP;
@@ -1066,14 +1679,49 @@ phc_est_sysctl_helper(SYSCTLFN_ARGS)
 		return error;
 
 	/* () input_string is different, process it () */
-
-	/* Parse input string one Voltage ID at a time */
-	remain = string = input_string;
-
 	vids = kmem_alloc(est_fqlist->n * sizeof(int), KM_SLEEP);
 	if (vids == NULL)
 		return ENOMEM;
 
+	if ((error = phc_parse_vids(input_string, vids)) != 0) {
+		kmem_free( vids, est_fqlist->n * sizeof(int));
+		return error;
+	}
+
+	/* Save new VIDs */
+	mutex_enter(&est_lock);
+	phc_set_vids(vids);
+
+	/* clean memory <!> */
+	kmem_free( vids, est_fqlist->n * sizeof(int));
+
+	/* save string for futur display */
+	strncpy ( phc_string_vids, input_string, PHC_MAXLEN);
+
+	/* reset MSR: reprogram the state the driver set, with the new VIDs */
+	est_set_state(EST_CURCPU()->ec_state);
+	est_notify(EST_NOTE_PHC);
+	mutex_exit(&est_lock);
+
+	/* Display raw VID voltages */
+	/*rnode->sysctl_data =  &phc_string_vids;*/
+
+	return 0;
+}
+
+/*
+ * PHC: parse one VID per state from string into vids[], checking each
+ * against the original VID.  Anything after the last VID is cut off.
+ */
+static int
+phc_parse_vids(char *input_string, int *vids)
+{
+	int			i;
+	char			*string,*remain;
+
+	/* Parse input string one Voltage ID at a time */
+	remain = string = input_string;
+
 	/* First round: check input values */
 	for( i = 0; i< est_fqlist->n; i++) {
 		int ref_vid = MSR2VOLTINC(phc_origin_table[i]);
@@ -1082,14 +1730,12 @@ phc_est_sysctl_helper(SYSCTLFN_ARGS)
 		if (vid == -1) {
 			printf("%s: require at least %d values\n",
 					__func__, est_fqlist->n);
-			kmem_free( vids, est_fqlist->n * sizeof(int));
 			return EINVAL;
 		}
 
 		if ( vid < 0 || vid > ref_vid ) {
 			printf("%s: %d VID out of bounds\n",
 					__func__, vid);
-			kmem_free( vids, est_fqlist->n * sizeof(int));
 			return EINVAL;
 		}
 
@@ -1103,7 +1749,20 @@ phc_est_sysctl_helper(SYSCTLFN_ARGS)
 	 * in case where input_string is too long */
 	*remain = '\0';
 
-	/* Save new VIDs */
+	return 0;
+}
+
+/*
+ * PHC: install parsed VIDs in the table.  The CPUs pick them up at
+ * their next transition.  Called with est_lock held.
+ */
+static void
+phc_set_vids(const int *vids)
+{
+	int			i;
+
+	KASSERT(mutex_owned(&est_lock));
+
 	for( i = 0; i< est_fqlist->n; i++) {
 		int ref_fid = MSR2FREQINC(phc_origin_table[i]);
 		fake_table[i] = PHC_ID16( ref_fid, vids[i]);
@@ -1112,92 +1771,2277 @@ phc_est_sysctl_helper(SYSCTLFN_ARGS)
 					, vids[i], ref_fid);
 #endif /* EST_DEBUG */
 	}
+}
 
-	/* clean memory <!> */
-	kmem_free( vids, est_fqlist->n * sizeof(int));
+/*
+ * PHC: apply the VIDs from the "est-phc-vids" property of the boot CPU,
+ * or else from the EST_PHC_VIDS kernel option, so that the system runs
+ * undervolted before /etc/sysctl.conf is read.  Only the boot CPU is
+ * running at this point; it is reprogrammed at once, and est_finalize()
+ * reprograms every domain once the other CPUs are up.
+ */
+static void
+phc_boot_vids(void)
+{
+	prop_string_t		ps;
+	const char		*src;
+	char			buf[PHC_MAXLEN];
+	struct est_cpu		*ec = EST_CURCPU();
+	uint64_t		msr;
+	int			*vids;
+
+	src = NULL;
+#ifdef EST_PHC_VIDS
+	src = EST_PHC_VIDS;
+#endif /* EST_PHC_VIDS */
+	ps = prop_dictionary_get(device_properties(curcpu()->ci_dev),
+	    "est-phc-vids");
+	if (ps != NULL && prop_object_type(ps) == PROP_TYPE_STRING)
+		src = prop_string_cstring_nocopy(ps);
+	if (src == NULL)
+		return;
 
-	/* save string for futur display */
-	strncpy ( phc_string_vids, input_string, PHC_MAXLEN);
+	strlcpy(buf, src, sizeof(buf));
+	vids = kmem_alloc(est_fqlist->n * sizeof(int), KM_SLEEP);
+	if (phc_parse_vids(buf, vids) != 0) {
+		aprint_error("%s: ignoring VID list \"%s\"\n", __func__, src);
+		kmem_free(vids, est_fqlist->n * sizeof(int));
+		return;
+	}
 
-	/* reset MSR */
-	fq = MSR2MHZ(rdmsr(MSR_PERF_STATUS), bus_clock);
-	for (i = est_fqlist->n - 1; i > 0; i--)
-		if (MSR2MHZ(est_fqlist->table[i], bus_clock) >= fq)
-			break;
-	fq = MSR2MHZ(est_fqlist->table[i], bus_clock);
-	mcb.msr_read = true;
-	mcb.msr_type = MSR_PERF_CTL;
-	mcb.msr_mask = 0xffffULL;
-	mcb.msr_value = est_fqlist->table[i];
-	msr_cpu_broadcast(&mcb);
+	mutex_enter(&est_lock);
+	phc_set_vids(vids);
+	strlcpy(phc_string_vids, buf, PHC_MAXLEN);
 
-	/* Display raw VID voltages */
-	/*rnode->sysctl_data =  &phc_string_vids;*/
+	msr = rdmsr(MSR_PERF_CTL) & ~0xffffULL;
+	ec->ec_perf_ctl = est_fqlist->table[ec->ec_state];
+	wrmsr(MSR_PERF_CTL, msr | ec->ec_perf_ctl);
+	est_shm_update();
+	phc_boot_applied = true;
+	mutex_exit(&est_lock);
 
-	return 0;
+	kmem_free(vids, est_fqlist->n * sizeof(int));
+	aprint_normal("%s: using VIDs %s\n", __func__, phc_string_vids);
+}
+
+/*
+ * PHC: rebuild phc_string_vids from the table.
+ */
+static void
+phc_vids_string(void)
+{
+	size_t			len;
+	int			i;
+
+	phc_string_vids[0] = '\0';
+	len = 0;
+	for (i = 0; i < est_fqlist->n && len < PHC_MAXLEN; i++)
+		len += snprintf(phc_string_vids + len, PHC_MAXLEN - len,
+		    "%d%s", MSR2VOLTINC(fake_table[i]),
+		    i < est_fqlist->n - 1 ? " " : "");
+}
+
+/*
+ * PHC: clear the corrected errors logged in the MCA banks of the
+ * current CPU and charge them to the state it is running.
+ */
+static void
+phc_mca_poll(struct est_cpu *ec)
+{
+	uint64_t		st;
+	int			i;
+
+	for (i = 0; i < phc_mca_nbanks; i++) {
+		st = rdmsr(MSR_MC0_STATUS + 4 * i);
+		/* uncorrected errors are left to the #MC handler */
+		if ((st & MCI_STATUS_VAL) == 0 || (st & MCI_STATUS_UC) != 0)
+			continue;
+		wrmsr(MSR_MC0_STATUS + 4 * i, 0);
+		ec->ec_mca_new[ec->ec_state]++;
+	}
+}
+
+/*
+ * PHC: charge the corrected errors found since the last sample and
+ * raise the VIDs of the states they hit.  Called with est_lock held.
+ */
+static void
+phc_mca_update(void)
+{
+	struct est_cpu		*ec;
+	int			c, i, fid, vid, ref;
+	bool			raised;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	for (c = 0; c < ncpu; c++) {
+		ec = &est_cpu[c];
+		for (i = 0; i < est_fqlist->n; i++) {
+			if (ec->ec_mca_new[i] == 0)
+				continue;
+			phc_mca_errors[i] += ec->ec_mca_new[i];
+			phc_mca_hit[i] = true;
+			ec->ec_mca_new[i] = 0;
+		}
+	}
+
+	raised = false;
+	for (i = 0; i < est_fqlist->n; i++) {
+		if (!phc_mca_hit[i])
+			continue;
+		phc_mca_hit[i] = false;
+
+		fid = MSR2FREQINC(fake_table[i]);
+		vid = MSR2VOLTINC(fake_table[i]);
+		ref = MSR2VOLTINC(phc_origin_table[i]);
+		if (vid < ref) {
+			fake_table[i] = PHC_ID16(fid, vid + 1);
+			raised = true;
+			log(LOG_WARNING, "est: corrected machine check at "
+			    "%d MHz, VID raised to %d\n",
+			    MSR2MHZ(fake_table[i], bus_clock), vid + 1);
+		} else
+			log(LOG_WARNING, "est: corrected machine check at "
+			    "%d MHz, original VID %d\n",
+			    MSR2MHZ(fake_table[i], bus_clock), vid);
+	}
+
+	if (raised) {
+		phc_vids_string();
+		est_set_state(EST_CURCPU()->ec_state);
+		est_notify(EST_NOTE_PHC);
+	}
 }
 
+/*
+ * PHC: corrected machine checks per state, as "n n n ...".
+ */
 static int
-est_sysctl_helper(SYSCTLFN_ARGS)
+phc_mca_sysctl_errors(SYSCTLFN_ARGS)
 {
-	struct msr_cpu_broadcast mcb;
 	struct sysctlnode	node;
-	int			fq, oldfq, error;
+	char			*buf;
+	size_t			buflen, len;
+	int			i, error;
 
-	if (est_fqlist == NULL)
+	if (est_fqlist == NULL || phc_mca_errors == NULL)
 		return EOPNOTSUPP;
 
-	node = *rnode;
-	node.sysctl_data = &fq;
-
-	oldfq = 0;
-	if (rnode->sysctl_num == est_node_target)
-		fq = oldfq = MSR2MHZ(rdmsr(MSR_PERF_CTL), bus_clock);
-	else if (rnode->sysctl_num == est_node_current)
-		fq = MSR2MHZ(rdmsr(MSR_PERF_STATUS), bus_clock);
-	else
-		return EOPNOTSUPP;
+	buflen = est_fqlist->n * 21 + 1;
+	buf = kmem_alloc(buflen, KM_SLEEP);
+	buf[0] = '\0';
+	len = 0;
+	mutex_enter(&est_lock);
+	for (i = 0; i < est_fqlist->n; i++)
+		len += snprintf(buf + len, buflen - len, "%llu%s",
+		    (unsigned long long)phc_mca_errors[i],
+		    i < est_fqlist->n - 1 ? " " : "");
+	mutex_exit(&est_lock);
 
+	node = *rnode;
+	node.sysctl_data = buf;
+	node.sysctl_size = len + 1;
 	error = sysctl_lookup(SYSCTLFN_CALL(&node));
-	if (error || newp == NULL)
-		return error;
 
-	/* support writing to ...frequency.target */
-	if (rnode->sysctl_num == est_node_target && fq != oldfq) {
-		int		i;
+	kmem_free(buf, buflen);
+	return error;
+}
 
-		for (i = est_fqlist->n - 1; i > 0; i--)
-			if (MSR2MHZ(est_fqlist->table[i], bus_clock) >= fq)
-				break;
-		fq = MSR2MHZ(est_fqlist->table[i], bus_clock);
-		mcb.msr_read = true;
-		mcb.msr_type = MSR_PERF_CTL;
-		mcb.msr_mask = 0xffffULL;
-		mcb.msr_value = est_fqlist->table[i];
-		msr_cpu_broadcast(&mcb);
-	}
+/*
+ * Return the index of the slowest state running at fq MHz or more,
+ * or the highest state if fq is above the table.
+ */
+static int
+est_freq_to_state(int fq)
+{
+	int			i;
 
-	return 0;
+	for (i = est_fqlist->n - 1; i > 0; i--)
+		if (MSR2MHZ(est_fqlist->table[i], bus_clock) >= fq)
+			break;
+	return i;
 }
 
+/*
+ * Slowest state the floors allow: the lower limit, the run queue, boost
+ * and QoS floors.  Also read locklessly by est_idle().
+ */
 static int
-est_init_once(void)
+est_floor_state(void)
 {
-	est_init_main(lvendor);
-	return 0;
+	int			i;
+
+	i = est_state_min;
+	if (i > est_runq_floor)
+		i = est_runq_floor;
+	if (i > est_boost_floor)
+		i = est_boost_floor;
+	if (i > est_qos_floor)
+		i = est_qos_floor;
+	return i;
 }
 
-void
-est_init(int vendor)
+/*
+ * Clamp a lease state to [est_state_max, est_state_min], which may have
+ * moved since the lease was taken.
+ */
+static int
+est_lease_clamp(int i)
 {
-	int error;
-	static ONCE_DECL(est_initialized);
-
-	lvendor = vendor;
-
-	error = RUN_ONCE(&est_initialized, est_init_once);
-	if (__predict_false(error != 0))
-		return;
+	return MIN(MAX(i, est_state_max), est_state_min);
+}
+
+/*
+ * Clamp i to the allowed window.  Caps win over floors.
+ */
+static int
+est_clamp_state(int i)
+{
+	if (est_lease_state >= 0)
+		return MAX(est_lease_clamp(est_lease_state), est_therm_state);
+	if (i > est_floor_state())
+		i = est_floor_state();
+	if (i < est_state_max)
+		i = est_state_max;
+	if (i < est_therm_state)
+		i = est_therm_state;
+	if (i < est_ipc_state)
+		i = est_ipc_state;
+	if (i < est_nice_state)
+		i = est_nice_state;
+	return i;
+}
+
+/*
+ * Charge the cycles since t0 to path k of the current CPU.
+ */
+static void
+est_ov_account(int k, uint64_t t0)
+{
+	struct est_cpu		*ec = EST_CURCPU();
+	uint64_t		d;
+
+	d = cpu_counter() - t0;
+	ec->ec_ov[k] += d;
+	if (d > ec->ec_ov_max[k])
+		ec->ec_ov_max[k] = d;
+}
+
+static void
+est_domain_init(void)
+{
+	CPU_INFO_ITERATOR	cii, cii2;
+	struct cpu_info		*ci, *ci2;
+	bool			known;
+	int			i;
+
+	known = true;
+	for (CPU_INFO_FOREACH(cii, ci))
+		for (CPU_INFO_FOREACH(cii2, ci2))
+			if (ci2 != ci &&
+			    ci2->ci_package_id == ci->ci_package_id &&
+			    ci2->ci_core_id == ci->ci_core_id &&
+			    ci2->ci_smt_id == ci->ci_smt_id)
+				known = false;
+
+	est_ndomains = 0;
+	for (CPU_INFO_FOREACH(cii, ci)) {
+		for (i = 0; known && i < est_ndomains; i++)
+			if (est_domain_cpu[i]->ci_package_id ==
+			    ci->ci_package_id &&
+			    est_domain_cpu[i]->ci_core_id == ci->ci_core_id)
+				break;
+		if ((!known || i == est_ndomains) && est_ndomains < MAXCPUS)
+			est_domain_cpu[est_ndomains++] = ci;
+	}
+	est_domain_ncpu = ncpu;
+
+#ifdef EST_DEBUG
+	printf("%s: %d CPUs in %d domains\n", __func__, ncpu, est_ndomains);
+#endif /* EST_DEBUG */
+}
+
+/*
+ * Write PERF_CTL value *arg1 on the current CPU; time the transition
+ * if arg2 is not NULL.
+ */
+static void
+est_xc_perf_ctl(void *arg1, void *arg2)
+{
+	struct timespec		ts;
+	uint64_t		msr, value, t0, start, now;
+	bool			settled;
+
+	t0 = cpu_counter();
+	/* errors so far belong to the state being left */
+	if (phc_mca_enable)
+		phc_mca_poll(EST_CURCPU());
+	value = *(uint64_t *)arg1;
+	msr = rdmsr(MSR_PERF_CTL);
+	msr = (msr & ~0xffffULL) | value;
+	/* nothing to time if the CPU already runs value */
+	if (arg2 == NULL || (rdmsr(MSR_PERF_STATUS) & 0xffff) == value) {
+		wrmsr(MSR_PERF_CTL, msr);
+		est_ov_account(EST_OV_TRANS, t0);
+		return;
+	}
+
+	nanouptime(&ts);
+	start = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	wrmsr(MSR_PERF_CTL, msr);
+	est_ov_account(EST_OV_TRANS, t0);
+	do {
+		settled = (rdmsr(MSR_PERF_STATUS) & 0xffff) == value;
+		nanouptime(&ts);
+		now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	} while (!settled && now - start < EST_TRANS_SPIN_NS);
+
+	if (settled)
+		EST_CURCPU()->ec_trans_ns = now - start;
+}
+
+/*
+ * Program table entry i on all CPUs, with one cross-call per domain.
+ * Called with est_lock held.
+ */
+static void
+est_set_state(int i)
+{
+	CPU_INFO_ITERATOR	cii;
+	struct cpu_info		*ci;
+	uint64_t		value, where, t0, t;
+	void			*timed;
+	int			d;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	t0 = cpu_counter();
+	if (est_domain_ncpu != ncpu)
+		est_domain_init();
+
+	/* non-NULL: measure the latency of this transition */
+	timed = est_trans_ns == 0 ||
+	    ++est_trans_count % EST_TRANS_SAMPLE == 0 ? &value : NULL;
+
+	value = est_fqlist->table[i];
+	/* only the CPUs that settle this time report a latency */
+	if (timed != NULL)
+		for (CPU_INFO_FOREACH(cii, ci))
+			est_cpu[cpu_index(ci)].ec_trans_ns = 0;
+	if (est_ndomains == ncpu) {
+		where = xc_broadcast(0, est_xc_perf_ctl, &value, timed);
+		est_stat_xcalls += ncpu;
+	} else {
+		for (d = 0; d < est_ndomains; d++)
+			where = xc_unicast(0, est_xc_perf_ctl, &value, timed,
+			    est_domain_cpu[d]);
+		est_stat_xcalls += est_ndomains;
+	}
+	xc_wait(where);
+
+	for (CPU_INFO_FOREACH(cii, ci)) {
+		est_cpu[cpu_index(ci)].ec_perf_ctl = value;
+		est_cpu[cpu_index(ci)].ec_state = i;
+	}
+	if (timed != NULL) {
+		t = 0;
+		for (CPU_INFO_FOREACH(cii, ci))
+			t = MAX(t, est_cpu[cpu_index(ci)].ec_trans_ns);
+		/* keep the last measurement if no CPU settled */
+		if (t != 0) {
+			est_trans_ns = t;
+			est_trans_max = MAX(est_trans_max, t);
+		}
+	}
+	est_ov_account(EST_OV_BCAST, t0);
+
+	est_shm_update();
+	est_notify(EST_NOTE_STATE);
+}
+
+/*
+ * Install a new [max, min] state window and move the CPUs back inside
+ * it if needed.  Called with est_lock held.
+ */
+static int
+est_update_limits(int max, int min)
+{
+	KASSERT(mutex_owned(&est_lock));
+
+	if (max < 0 || min >= (int)est_fqlist->n || max > min)
+		return EINVAL;
+
+	est_state_max = max;
+	est_state_min = min;
+
+	est_apply();
+
+	return 0;
+}
+
+/*
+ * Program the requested state, clamped, if the CPUs are not already
+ * running it.  Called with est_lock held.
+ */
+static void
+est_apply(void)
+{
+	int			i;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	i = est_clamp_state(est_req_state);
+	if (est_lease_state >= 0 && i != est_lease_state)
+		est_lease_capped = true;
+	if (i != EST_CURCPU()->ec_state)
+		est_set_state(i);
+}
+
+/* ARGSUSED */
+static void
+est_work(struct work *wk, void *arg)
+{
+	if (wk == &est_coalesce_wk)
+		est_coalesce_work();
+	else if (wk == &est_sample_wk)
+		est_sample();
+	else if (wk == &est_boost_wk)
+		est_boost_work();
+	else if (wk == &est_lease_wk)
+		est_lease_work();
+	else if (wk == &est_runq_wk)
+		est_runq_work();
+}
+
+static void
+est_coalesce_tick(void *arg)
+{
+	workqueue_enqueue(est_wq, &est_coalesce_wk, NULL);
+}
+
+static void
+est_coalesce_work(void)
+{
+	mutex_enter(&est_lock);
+	if (est_pending_state >= 0) {
+		est_req_state = est_pending_state;
+		est_pending_state = -1;
+		est_apply();
+		est_stat_applied++;
+	}
+	mutex_exit(&est_lock);
+}
+
+/*
+ * End the coalescing window now: apply the pending write, or drop it if
+ * apply is false.  A callout or work already on its way finds nothing
+ * pending.  Called with est_lock held.
+ */
+static void
+est_coalesce_stop(bool apply)
+{
+	KASSERT(mutex_owned(&est_lock));
+
+	if (est_pending_state < 0)
+		return;
+
+	callout_stop(&est_coalesce_ch);
+	if (apply) {
+		est_req_state = est_pending_state;
+		est_pending_state = -1;
+		est_apply();
+		est_stat_applied++;
+	} else {
+		est_pending_state = -1;
+		est_shm_update();
+	}
+}
+
+/*
+ * machdep.est.frequency.coalesce_ms: turning coalescing off applies the
+ * pending write at once.
+ */
+static int
+est_sysctl_coalesce(SYSCTLFN_ARGS)
+{
+	struct sysctlnode	node;
+	int			val, error;
+
+	node = *rnode;
+	val = est_coalesce_ms;
+	node.sysctl_data = &val;
+
+	error = sysctl_lookup(SYSCTLFN_CALL(&node));
+	if (error || newp == NULL)
+		return error;
+	if (val < 0)
+		return EINVAL;
+
+	mutex_enter(&est_lock);
+	est_coalesce_ms = val;
+	if (val == 0)
+		est_coalesce_stop(true);
+	mutex_exit(&est_lock);
+
+	return 0;
+}
+
+static bool
+est_sample_active(void)
+{
+	/* unlocked: read est_gov once */
+	const struct est_governor *eg = est_gov;
+
+	return est_therm_enable || est_pmc_enable || est_runq_enable ||
+	    est_nice_enable || phc_mca_enable ||
+	    eg->eg_sample != NULL || eg->eg_select_state != NULL;
+}
+
+static void
+est_sample_schedule(void)
+{
+	int			ms;
+
+	ms = est_adapt_enable ? est_sample_cur_ms : est_sample_ms;
+	if (est_sample_active())
+		callout_schedule(&est_sample_ch, MAX(mstohz(ms), 1));
+}
+
+static void
+est_sample_tick(void *arg)
+{
+	atomic_inc_64(&est_stat_wakeups);
+
+	/* a work may not be queued twice */
+	if (atomic_swap_uint(&est_sample_queued, 1) == 0)
+		workqueue_enqueue(est_wq, &est_sample_wk, NULL);
+}
+
+/*
+ * Per-CPU part of a sample.  arg1 is the governor est_sample() read
+ * once, so that every CPU calls the same eg_sample.
+ */
+/* ARGSUSED */
+static void
+est_xc_sample(void *arg1, void *arg2)
+{
+	const struct est_governor *eg = arg1;
+	struct est_cpu		*ec = EST_CURCPU();
+	uint64_t		*cp_time, total, idle, t0;
+	int			i;
+
+	t0 = cpu_counter();
+
+	if (est_therm_enable)
+		ec->ec_therm = rdmsr(MSR_THERM_STATUS);
+
+	cp_time = curcpu()->ci_schedstate.spc_cp_time;
+	total = 0;
+	for (i = 0; i < CPUSTATES; i++)
+		total += cp_time[i] - ec->ec_cp_time[i];
+	idle = cp_time[CP_IDLE] - ec->ec_cp_time[CP_IDLE];
+	i = total == 0 ? 0 : (total - idle) * 1000 / total;
+	ec->ec_util_delta = abs(i - ec->ec_util);
+	ec->ec_util = i;
+	ec->ec_nice = total == idle ? 0 :
+	    (cp_time[CP_NICE] - ec->ec_cp_time[CP_NICE]) * 1000 /
+	    (total - idle);
+	memcpy(ec->ec_cp_time, cp_time, sizeof(ec->ec_cp_time));
+
+	if (est_pmc_enable) {
+		uint64_t inst, cycles, dinst, dcycles, now;
+		struct timespec ts;
+
+		nanouptime(&ts);
+		now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+		inst = rdmsr(MSR_PERFCTR0);
+		cycles = rdmsr(MSR_PERFCTR1);
+		dinst = (inst - ec->ec_inst) & EST_PMC_MASK;
+		dcycles = (cycles - ec->ec_cycles) & EST_PMC_MASK;
+		ec->ec_ipc = dcycles == 0 ? -1 : dinst * 100 / dcycles;
+		if (ec->ec_sample_ns != 0 && now > ec->ec_sample_ns &&
+		    ec->ec_util > 0)
+			ec->ec_eff_mhz = dcycles * 1000 * 1000 /
+			    ((now - ec->ec_sample_ns) * ec->ec_util);
+		else
+			ec->ec_eff_mhz = 0;
+		ec->ec_inst = inst;
+		ec->ec_cycles = cycles;
+		ec->ec_sample_ns = now;
+	}
+
+	if (phc_mca_enable)
+		phc_mca_poll(ec);
+
+	if (eg->eg_sample != NULL)
+		(*eg->eg_sample)(ec);
+
+	est_ov_account(EST_OV_SAMPLE, t0);
+}
+
+/*
+ * True if the CPUs have the P6 PMU programmed by est_xc_pmc: Intel
+ * family 6 without architectural performance monitoring.
+ */
+static bool
+est_pmc_p6(void)
+{
+	u_int			regs[4];
+
+	if (est_fqlist->vendor != CPUVENDOR_INTEL ||
+	    CPUID2FAMILY(curcpu()->ci_signature) != 6)
+		return false;
+	x86_cpuid(0, regs);
+	if (regs[0] < 0x0a)
+		return true;
+	x86_cpuid(0x0a, regs);
+	return (regs[0] & 0xff) == 0;
+}
+
+/*
+ * Start (arg1 != NULL) or stop the instruction and cycle counters.
+ */
+/* ARGSUSED */
+static void
+est_xc_pmc(void *arg1, void *arg2)
+{
+	struct est_cpu		*ec = EST_CURCPU();
+
+	wrmsr(MSR_PERFEVTSEL0, 0);
+	wrmsr(MSR_PERFEVTSEL1, 0);
+	ec->ec_sample_ns = 0;
+	ec->ec_eff_mhz = 0;
+	ec->ec_ipc = -1;
+	if (arg1 == NULL)
+		return;
+
+	wrmsr(MSR_PERFCTR0, 0);
+	wrmsr(MSR_PERFCTR1, 0);
+	ec->ec_inst = ec->ec_cycles = 0;
+	wrmsr(MSR_PERFEVTSEL1,
+	    EST_PMC_CLK_UNHALTED | EST_PMC_USR | EST_PMC_OS);
+	wrmsr(MSR_PERFEVTSEL0,
+	    EST_PMC_INST_RETIRED | EST_PMC_USR | EST_PMC_OS | EST_PMC_EN);
+}
+
+static void
+est_sample(void)
+{
+	uint64_t		t0;
+	int			i, prev;
+
+	est_sample_queued = 0;
+	if (!est_sample_active()) {
+		est_wake_rate = 0;
+		est_wake_t0 = 0;
+		return;
+	}
+
+	xc_wait(xc_broadcast(0, est_xc_sample, est_gov, NULL));
+
+	mutex_enter(&est_lock);
+	t0 = cpu_counter();
+	prev = EST_CURCPU()->ec_state;
+	if (est_therm_enable)
+		est_therm_update();
+	if (est_pmc_enable && est_ipc_threshold > 0)
+		est_ipc_update();
+	if (est_runq_enable)
+		est_runq_update();
+	if (est_nice_enable)
+		est_nice_update();
+	if (phc_mca_enable)
+		phc_mca_update();
+	if (est_lease_state < 0 && est_gov->eg_select_state != NULL &&
+	    (i = (*est_gov->eg_select_state)()) >= 0)
+		est_req_state = i;
+	est_ov_account(EST_OV_DECIDE, t0);
+	est_apply();
+	est_adapt(prev);
+	est_wake_update();
+	mutex_exit(&est_lock);
+
+	est_sample_schedule();
+}
+
+/*
+ * Pick the next sampling period, see est_adapt_enable.  prev is the
+ * state before this sample.  Called with est_lock held.
+ */
+static void
+est_adapt(int prev)
+{
+	int			c, delta, util, floor, ms;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	delta = util = 0;
+	for (c = 0; c < ncpu; c++) {
+		delta = MAX(delta, est_cpu[c].ec_util_delta);
+		util = MAX(util, est_cpu[c].ec_util);
+	}
+
+	ms = est_sample_cur_ms;
+	if (util < EST_ADAPT_IDLE)
+		ms *= 2;
+	else if (delta >= EST_ADAPT_DELTA)
+		ms = 0;
+	else if (EST_CURCPU()->ec_state == prev)
+		ms *= 2;
+	else
+		ms /= 2;
+
+	floor = MAX(est_sample_min_ms,
+	    (int)(est_trans_ns * EST_ADAPT_TRANS / 1000000));
+	est_sample_cur_ms = MAX(MIN(ms, est_sample_max_ms), floor);
+}
+
+/*
+ * Refresh est_wake_rate every EST_WAKE_WINDOW seconds.  Called with
+ * est_lock held.
+ */
+static void
+est_wake_update(void)
+{
+	int			now;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	now = hardclock_ticks;
+	if (est_wake_t0 == 0) {
+		est_wake_t0 = now | 1;
+		est_wake_n0 = est_stat_wakeups;
+	} else if (now - est_wake_t0 >= EST_WAKE_WINDOW * hz) {
+		est_wake_rate = (est_stat_wakeups - est_wake_n0) * 100 * hz /
+		    (now - est_wake_t0);
+		est_wake_t0 = now | 1;
+		est_wake_n0 = est_stat_wakeups;
+	}
+}
+
+/*
+ * Move the thermal cap one state at a time.  Called with est_lock held.
+ */
+static void
+est_therm_update(void)
+{
+	uint32_t		st;
+	bool			hot, cool;
+	int			c;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	hot = false;
+	cool = true;
+	for (c = 0; c < ncpu; c++) {
+		st = est_cpu[c].ec_therm;
+		if ((st & THERM_STATUS_HOT) != 0 ||
+		    ((st & THERM_STATUS_VALID) != 0 &&
+		    THERM_STATUS_READOUT(st) <= est_therm_margin))
+			hot = true;
+		else if ((st & THERM_STATUS_VALID) != 0 &&
+		    THERM_STATUS_READOUT(st) <
+		    est_therm_margin + est_therm_hyst)
+			cool = false;
+	}
+
+	if (hot) {
+		est_therm_cool = 0;
+		if (est_therm_state < (int)est_fqlist->n - 1) {
+			est_therm_state++;
+			est_stat_therm_down++;
+		}
+	} else if (cool && est_therm_state > 0) {
+		if (++est_therm_cool >= est_therm_holdoff) {
+			est_therm_cool = 0;
+			est_therm_state--;
+			est_stat_therm_up++;
+		}
+	} else
+		est_therm_cool = 0;
+}
+
+static int
+est_pb_init(void)
+{
+	est_pb_credit = 0;
+	return 0;
+}
+
+/*
+ * Choose the state for the power budget.  Called with est_lock held.
+ */
+static int
+est_pb_select(void)
+{
+	uint16_t		cur[MAXCPUS];
+	uint64_t		power;
+	int			util[MAXCPUS];
+	int			c, i;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	if (est_pb_budget == 0)
+		return -1;
+
+	for (c = 0; c < ncpu; c++) {
+		cur[c] = est_cpu[c].ec_perf_ctl;
+		util[c] = est_cpu[c].ec_util;
+	}
+	i = est_model_pb_select(est_fqlist->table, est_fqlist->n, bus_clock,
+	    est_ceff_pf, cur, util, ncpu, est_pb_budget, &est_pb_credit,
+	    &power);
+	est_pb_power = power;
+	return i;
+}
+
+static int
+est_ewma_init(void)
+{
+	int			c;
+
+	for (c = 0; c < MAXCPUS; c++) {
+		est_cpu[c].ec_ewma = est_cpu[c].ec_predict = 0;
+		est_cpu[c].ec_hist_pos = 0;
+	}
+	return 0;
+}
+
+/*
+ * Runs on each CPU from the sample cross-call.
+ */
+static void
+est_ewma_sample(struct est_cpu *ec)
+{
+	int			demand, p;
+
+	demand = ec->ec_util * MSR2MHZ(ec->ec_perf_ctl, bus_clock) / 1000;
+	ec->ec_ewma = (est_ewma_alpha * demand +
+	    (100 - est_ewma_alpha) * ec->ec_ewma) / 100;
+	ec->ec_hist[ec->ec_hist_pos++ % EST_EWMA_HIST] = demand;
+
+	ec->ec_predict = ec->ec_ewma;
+	if (est_ewma_period && (p = est_ewma_periodic(ec)) >= 0)
+		ec->ec_predict = p;
+}
+
+/*
+ * Find the lag that best repeats the demand history.  Return the
+ * demand one period before the next sample, or -1 if no lag matches
+ * within 10% of the mean demand.
+ */
+static int
+est_ewma_periodic(struct est_cpu *ec)
+{
+#define H(i)	(ec->ec_hist[(i) % EST_EWMA_HIST])
+	u_int			n = ec->ec_hist_pos;
+	int			lag, k, err, best, bestlag, sum;
+
+	if (n < EST_EWMA_HIST)
+		return -1;
+
+	sum = 0;
+	for (k = 0; k < EST_EWMA_HIST; k++)
+		sum += H(n - 1 - k);
+
+	best = INT_MAX;
+	bestlag = 0;
+	for (lag = 2; lag <= EST_EWMA_HIST / 2; lag++) {
+		err = 0;
+		for (k = 0; k < EST_EWMA_HIST - lag; k++)
+			err += abs(H(n - 1 - k) - H(n - 1 - k - lag));
+		err /= EST_EWMA_HIST - lag;
+		if (err < best) {
+			best = err;
+			bestlag = lag;
+		}
+	}
+
+	if (sum == 0 || best * 10 * EST_EWMA_HIST > sum)
+		return -1;
+	return H(n - bestlag);
+#undef H
+}
+
+/*
+ * Called with est_lock held.
+ */
+static int
+est_ewma_select(void)
+{
+	int			c, i, demand;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	demand = 0;
+	for (c = 0; c < ncpu; c++)
+		demand = MAX(demand, est_cpu[c].ec_predict);
+
+	for (i = est_fqlist->n - 1; i > 0; i--)
+		if (MSR2MHZ(est_fqlist->table[i], bus_clock) *
+		    EST_EWMA_LOAD / 100 >= demand)
+			break;
+	return i;
+}
+
+/*
+ * Move the IPC cap one state at a time.  Idle CPUs and CPUs without
+ * counter data do not vote.
+ * Called with est_lock held.
+ */
+static void
+est_ipc_update(void)
+{
+	int			c, ipc, busy;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	ipc = INT_MAX;
+	busy = 0;
+	for (c = 0; c < ncpu; c++) {
+		if (est_cpu[c].ec_util < EST_BUSY || est_cpu[c].ec_ipc < 0)
+			continue;
+		busy++;
+		ipc = MIN(ipc, est_cpu[c].ec_ipc);
+	}
+	est_ipc_last = busy ? ipc : 0;
+
+	if (busy && ipc < est_ipc_threshold) {
+		/* every busy CPU is stalled */
+		if (est_ipc_state < (int)est_fqlist->n - 1) {
+			est_ipc_state++;
+			est_stat_ipc_down++;
+		}
+		return;
+	}
+
+	for (c = 0; c < ncpu; c++)
+		if (est_cpu[c].ec_util >= EST_BUSY &&
+		    est_cpu[c].ec_ipc >= est_ipc_threshold + est_ipc_hyst)
+			break;
+	if ((c < ncpu || !busy) && est_ipc_state > 0) {
+		est_ipc_state--;
+		est_stat_ipc_up++;
+	}
+}
+
+/*
+ * Probe the run queue, see est_runq_enable.
+ */
+static void
+est_runq_tick(void *arg)
+{
+	bool			queued;
+	int			want;
+
+	atomic_inc_64(&est_stat_wakeups);
+	if (!est_runq_enable)
+		return;
+
+	queued = sched_curcpu_runnable_p();
+	if (est_runq_floor != 0) {
+		if (!queued) {
+			/* keep probing while there is work to wait for */
+			if (est_runq_busy)
+				callout_schedule(&est_runq_ch,
+				    MAX(mstohz(est_runq_probe_ms), 1));
+			return;
+		}
+		want = 0;
+	} else {
+		if (queued)
+			return;
+		want = est_fqlist->n - 1;
+	}
+
+	est_runq_want = want;
+	if (atomic_swap_uint(&est_runq_queued, 1) == 0)
+		workqueue_enqueue(est_wq, &est_runq_wk, NULL);
+}
+
+static void
+est_runq_work(void)
+{
+	int			want;
+
+	est_runq_queued = 0;
+	want = est_runq_want;
+
+	mutex_enter(&est_lock);
+	if (est_runq_enable && want != est_runq_floor) {
+		if (want == 0)
+			est_stat_runq_boosts++;
+		est_runq_floor = want;
+		est_apply();
+	}
+	/* the floor is down again: resume probing */
+	if (est_runq_enable && est_runq_floor != 0 && est_runq_busy)
+		callout_schedule(&est_runq_ch,
+		    MAX(mstohz(est_runq_probe_ms), 1));
+	mutex_exit(&est_lock);
+}
+
+/*
+ * Arm the probe for the next interval.  Called with est_lock held.
+ */
+static void
+est_runq_update(void)
+{
+	int			c;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	for (c = 0; c < ncpu; c++)
+		if (est_cpu[c].ec_util >= EST_BUSY)
+			break;
+	est_runq_busy = c < ncpu;
+
+	/* with the floor up, one probe decides whether it stays */
+	if (est_runq_floor == 0 || est_runq_busy)
+		callout_schedule(&est_runq_ch,
+		    MAX(mstohz(est_runq_probe_ms), 1));
+}
+
+/*
+ * Called with est_lock held.
+ */
+static void
+est_nice_update(void)
+{
+	int			c, busy;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	busy = 0;
+	for (c = 0; c < ncpu; c++) {
+		if (est_cpu[c].ec_util < EST_BUSY)
+			continue;
+		if (est_cpu[c].ec_nice < est_nice_share * 10)
+			break;
+		busy++;
+	}
+
+	if (c == ncpu && busy > 0) {
+		if (est_nice_state != est_nice_target)
+			est_stat_nice_caps++;
+		est_nice_state = est_nice_target;
+	} else
+		est_nice_state = 0;
+}
+
+/*
+ * Boost the CPUs for est_boost_ms, e.g. on a keystroke.  Safe to call
+ * from interrupt context.
+ */
+void
+est_boost(void)
+{
+	int			now;
+
+	if (est_fqlist == NULL || !est_boost_enable)
+		return;
+
+	now = hardclock_ticks;
+	if (est_stat_boosts != 0 &&
+	    now - est_boost_last < mstohz(est_boost_interval_ms)) {
+		atomic_inc_64(&est_stat_boosts_limited);
+		return;
+	}
+	est_boost_last = now;
+	atomic_inc_64(&est_stat_boosts);
+
+	if (atomic_swap_uint(&est_boost_queued, 1) == 0)
+		workqueue_enqueue(est_wq, &est_boost_wk, NULL);
+}
+
+static void
+est_boost_tick(void *arg)
+{
+	atomic_inc_64(&est_stat_wakeups);
+	if (atomic_swap_uint(&est_boost_queued, 1) == 0)
+		workqueue_enqueue(est_wq, &est_boost_wk, NULL);
+}
+
+/*
+ * Raise the floor for a new boost, or drop it once the last boost has
+ * expired.
+ */
+static void
+est_boost_work(void)
+{
+	int			left;
+
+	est_boost_queued = 0;
+
+	mutex_enter(&est_lock);
+	left = mstohz(est_boost_ms) - (hardclock_ticks - est_boost_last);
+	if (left > 0 && est_boost_enable) {
+		est_boost_floor = est_boost_state;
+		callout_schedule(&est_boost_ch, left);
+	} else
+		est_boost_floor = est_fqlist->n - 1;
+	est_apply();
+	mutex_exit(&est_lock);
+}
+
+static void
+est_lease_tick(void *arg)
+{
+	atomic_inc_64(&est_stat_wakeups);
+	if (atomic_swap_uint(&est_lease_queued, 1) == 0)
+		workqueue_enqueue(est_wq, &est_lease_wk, NULL);
+}
+
+static void
+est_lease_work(void)
+{
+	est_lease_queued = 0;
+
+	mutex_enter(&est_lock);
+	/* the lease may have been renewed since the callout fired */
+	if (est_lease_state >= 0 && hardclock_ticks - est_lease_end >= 0)
+		est_lease_release();
+	mutex_exit(&est_lock);
+}
+
+/*
+ * Called with est_lock held.
+ */
+static void
+est_lease_release(void)
+{
+	struct est_lease	el;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	est_lease_stat(&el);
+	est_lease_state = -1;
+	est_lease_proc = NULL;
+	callout_stop(&est_lease_ch);
+	est_apply();
+
+#ifdef EST_DEBUG
+	printf("%s: lease released%s\n", __func__,
+	    el.el_throttled ? ", throttled" : "");
+#endif /* EST_DEBUG */
+}
+
+/*
+ * Describe the current lease, or the last one if none is held.
+ * Called with est_lock held.
+ */
+static void
+est_lease_stat(struct est_lease *el)
+{
+	volatile u_int		hot;
+	int			left;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	el->el_state = est_lease_state;
+	el->el_ms = 0;
+	if (est_lease_state >= 0) {
+		el->el_state = est_lease_clamp(est_lease_state);
+		hot = 0;
+		if (cpu_feature & CPUID_ACPI)
+			xc_wait(xc_broadcast(0, est_xc_therm_log,
+			    NULL, __UNVOLATILE(&hot)));
+		est_lease_throttled = est_lease_capped || hot != 0;
+		left = est_lease_end - hardclock_ticks;
+		el->el_ms = left > 0 ? (int)((int64_t)left * 1000 / hz) : 0;
+	}
+	el->el_throttled = est_lease_throttled;
+}
+
+/*
+ * Clear the THERM_STATUS log bit (arg1 != NULL) or report it in the
+ * u_int at arg2.
+ */
+/* ARGSUSED */
+static void
+est_xc_therm_log(void *arg1, void *arg2)
+{
+	uint64_t		msr;
+
+	msr = rdmsr(MSR_THERM_STATUS);
+	if (arg1 != NULL)
+		wrmsr(MSR_THERM_STATUS, msr & ~(uint64_t)THERM_STATUS_LOG);
+	else if ((msr & THERM_STATUS_LOG) != 0)
+		atomic_swap_uint(arg2, 1);
+}
+
+/*
+ * exithook: drop the lease and QoS request of an exiting process.
+ */
+/* ARGSUSED */
+static void
+est_proc_exit(struct proc *p, void *arg)
+{
+	if (est_lease_proc != p && LIST_EMPTY(&est_qos_list))
+		return;
+
+	mutex_enter(&est_lock);
+	if (est_lease_proc == p)
+		est_lease_release();
+	mutex_exit(&est_lock);
+
+	est_qos_proc(p, 0);
+}
+
+/*
+ * Recompute the QoS floor.  Called with est_lock held.
+ */
+static void
+est_qos_recalc(void)
+{
+	struct est_qos		*eq;
+	int			floor, n;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	floor = est_fqlist->n - 1;
+	n = 0;
+	LIST_FOREACH(eq, &est_qos_list, eq_list) {
+		floor = MIN(floor, eq->eq_state);
+		n++;
+	}
+	est_qos_floor = floor;
+	est_qos_nreq = n;
+	est_qos_mhz = n == 0 ? 0 :
+	    MSR2MHZ(est_fqlist->table[floor], bus_clock);
+	est_apply();
+}
+
+/*
+ * Register a request for at least mhz.  Returns NULL if the driver is
+ * not running.  May sleep.
+ */
+struct est_qos *
+est_qos_add(int mhz)
+{
+	struct est_qos		*eq;
+
+	if (est_fqlist == NULL)
+		return NULL;
+
+	eq = kmem_alloc(sizeof(*eq), KM_SLEEP);
+	eq->eq_proc = NULL;
+
+	mutex_enter(&est_lock);
+	eq->eq_state = est_freq_to_state(mhz);
+	LIST_INSERT_HEAD(&est_qos_list, eq, eq_list);
+	est_qos_recalc();
+	mutex_exit(&est_lock);
+
+	return eq;
+}
+
+/*
+ * Change the frequency of a request.  May sleep.
+ */
+int
+est_qos_update(struct est_qos *eq, int mhz)
+{
+	if (mhz <= 0)
+		return EINVAL;
+
+	mutex_enter(&est_lock);
+	eq->eq_state = est_freq_to_state(mhz);
+	est_qos_recalc();
+	mutex_exit(&est_lock);
+
+	return 0;
+}
+
+/*
+ * Withdraw a request.  May sleep.
+ */
+void
+est_qos_remove(struct est_qos *eq)
+{
+	mutex_enter(&est_lock);
+	LIST_REMOVE(eq, eq_list);
+	est_qos_recalc();
+	mutex_exit(&est_lock);
+
+	kmem_free(eq, sizeof(*eq));
+}
+
+/*
+ * Set the request of process p to mhz, or withdraw it if mhz is 0.
+ * A NULL p withdraws the requests of every process.
+ */
+static int
+est_qos_proc(struct proc *p, int mhz)
+{
+	struct est_qos		*eq, *next, *neq;
+
+	if (mhz < 0)
+		return EINVAL;
+
+	neq = mhz == 0 ? NULL : kmem_alloc(sizeof(*neq), KM_SLEEP);
+
+	mutex_enter(&est_lock);
+	for (eq = LIST_FIRST(&est_qos_list); eq != NULL; eq = next) {
+		next = LIST_NEXT(eq, eq_list);
+		if (eq->eq_proc == NULL || (p != NULL && eq->eq_proc != p))
+			continue;
+		if (neq != NULL) {
+			/* update in place */
+			eq->eq_state = est_freq_to_state(mhz);
+			est_qos_recalc();
+			mutex_exit(&est_lock);
+			kmem_free(neq, sizeof(*neq));
+			return 0;
+		}
+		LIST_REMOVE(eq, eq_list);
+		kmem_free(eq, sizeof(*eq));
+	}
+	if (neq != NULL) {
+		neq->eq_state = est_freq_to_state(mhz);
+		neq->eq_proc = p;
+		LIST_INSERT_HEAD(&est_qos_list, neq, eq_list);
+	}
+	est_qos_recalc();
+	mutex_exit(&est_lock);
+
+	return 0;
+}
+
+/*
+ * x86_cpu_idle replacement, see est_idle_enable.
+ */
+static void
+est_idle(void)
+{
+	struct est_cpu		*ec = EST_CURCPU();
+	struct timespec		ts;
+	uint64_t		msr, t0, ns;
+	int			i;
+
+	if (est_lease_state >= 0)
+		ec->ec_idle_since = 0;
+	else if (ec->ec_idle_since == 0 && !est_race_enable)
+		ec->ec_idle_since = hardclock_ticks | 1;
+	else if (!ec->ec_idle_low && (est_race_enable ||
+	    hardclock_ticks - ec->ec_idle_since >= mstohz(est_idle_ms))) {
+		i = est_race_enable ? (int)est_fqlist->n - 1 : est_idle_state;
+		i = MIN(i, est_floor_state());
+		if (i > ec->ec_state) {
+			msr = rdmsr(MSR_PERF_CTL) & ~0xffffULL;
+			wrmsr(MSR_PERF_CTL, msr | est_fqlist->table[i]);
+			nanouptime(&ts);
+			ec->ec_idle_low_ns =
+			    (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+			ec->ec_idle_low = true;
+			ec->ec_idle_drops++;
+		}
+	}
+
+	(*est_idle_prev)();
+
+	if (!sched_curcpu_runnable_p())
+		return;
+
+	if (ec->ec_idle_low) {
+		nanouptime(&ts);
+		t0 = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+		msr = rdmsr(MSR_PERF_CTL) & ~0xffffULL;
+		wrmsr(MSR_PERF_CTL, msr | ec->ec_perf_ctl);
+		nanouptime(&ts);
+		ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec - t0;
+		if (t0 > ec->ec_idle_low_ns)
+			ec->ec_idle_time_ns += t0 - ec->ec_idle_low_ns;
+		ec->ec_idle_restores++;
+		ec->ec_idle_lat_ns += ns;
+		if (ns > ec->ec_idle_lat_max)
+			ec->ec_idle_lat_max = ns;
+		ec->ec_idle_low = false;
+	}
+	ec->ec_idle_since = 0;
+}
+
+/*
+ * Install or remove est_idle().  Called with est_lock held.
+ */
+static void
+est_idle_hook(bool on)
+{
+	CPU_INFO_ITERATOR	cii;
+	struct cpu_info		*ci;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	if (on == est_idle_installed)
+		return;
+
+	if (on) {
+		if (est_idle_prev == NULL)
+			est_idle_prev = x86_cpu_idle;
+		x86_cpu_idle = est_idle;
+	} else {
+		/* CPUs already inside est_idle() still see est_idle_prev */
+		x86_cpu_idle = est_idle_prev;
+
+		/* bring the CPUs left at est_idle_state back */
+		for (CPU_INFO_FOREACH(cii, ci))
+			est_cpu[cpu_index(ci)].ec_idle_low = false;
+		est_set_state(EST_CURCPU()->ec_state);
+	}
+	est_idle_installed = on;
+}
+
+/*
+ * The idle hook writes its own PERF_CTL, so it needs one per CPU.
+ * Called with est_lock held.
+ */
+static int
+est_idle_check(void)
+{
+	KASSERT(mutex_owned(&est_lock));
+
+	if (est_domain_ncpu != ncpu)
+		est_domain_init();
+	return est_ndomains != ncpu ? EOPNOTSUPP : 0;
+}
+
+static int
+est_race_init(void)
+{
+	int			error;
+
+	if ((error = est_idle_check()) != 0)
+		return error;
+
+	est_race_enable = 1;
+	est_idle_hook(true);
+	est_req_state = 0;
+	return 0;
+}
+
+static int
+est_race_select(void)
+{
+	return 0;
+}
+
+static void
+est_race_teardown(void)
+{
+	est_race_enable = 0;
+	est_idle_hook(est_idle_enable != 0);
+}
+
+static int
+est_governor_register(struct est_governor *eg)
+{
+	struct est_governor	*g;
+
+	if (strlen(eg->eg_name) >= EST_GOV_NAMELEN)
+		return EINVAL;
+
+	LIST_FOREACH(g, &est_governors, eg_list)
+		if (strcmp(g->eg_name, eg->eg_name) == 0)
+			return EEXIST;
+
+	LIST_INSERT_HEAD(&est_governors, eg, eg_list);
+	return 0;
+}
+
+/*
+ * Replace the current governor.  Called with est_lock held.
+ */
+static int
+est_governor_select(const char *name)
+{
+	struct est_governor	*eg;
+	int			error;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	LIST_FOREACH(eg, &est_governors, eg_list)
+		if (strcmp(eg->eg_name, name) == 0)
+			break;
+	if (eg == NULL)
+		return EINVAL;
+	if (eg == est_gov)
+		return 0;
+
+	if (est_gov->eg_teardown != NULL)
+		(*est_gov->eg_teardown)();
+	if (eg->eg_init != NULL && (error = (*eg->eg_init)()) != 0) {
+		/* keep the previous governor running */
+		if (est_gov->eg_init != NULL)
+			(void)(*est_gov->eg_init)();
+		return error;
+	}
+	est_gov = eg;
+	/* only userspace takes target writes */
+	if (eg != &est_gov_userspace)
+		est_coalesce_stop(false);
+
+	return 0;
+}
+
+/*
+ * machdep.est.governor.current and .available
+ */
+static int
+est_sysctl_govname(SYSCTLFN_ARGS)
+{
+	struct sysctlnode	node;
+	struct est_governor	*eg;
+	char			buf[EST_GOV_NAMELEN * 8];
+	int			error;
+
+	if (est_fqlist == NULL)
+		return EOPNOTSUPP;
+
+	node = *rnode;
+	node.sysctl_data = buf;
+
+	if (rnode->sysctl_num != est_node_gov_current) {
+		buf[0] = '\0';
+		LIST_FOREACH(eg, &est_governors, eg_list) {
+			if (buf[0] != '\0')
+				strlcat(buf, " ", sizeof(buf));
+			strlcat(buf, eg->eg_name, sizeof(buf));
+		}
+		node.sysctl_size = strlen(buf) + 1;
+		return sysctl_lookup(SYSCTLFN_CALL(&node));
+	}
+
+	strlcpy(buf, est_gov->eg_name, EST_GOV_NAMELEN);
+	node.sysctl_size = EST_GOV_NAMELEN;
+	error = sysctl_lookup(SYSCTLFN_CALL(&node));
+	if (error || newp == NULL)
+		return error;
+
+	mutex_enter(&est_lock);
+	if (est_lease_state >= 0)
+		error = EBUSY;
+	else
+		error = est_governor_select(buf);
+	est_apply();
+	mutex_exit(&est_lock);
+
+	est_sample_schedule();
+	return error;
+}
+
+/*
+ * Read-only sum of a uint64_t est_cpu field over all CPUs; the node
+ * data points to the field of est_cpu[0].  Fields named *_max report
+ * the maximum instead.
+ */
+static int
+est_sysctl_cpusum(SYSCTLFN_ARGS)
+{
+	struct sysctlnode	node;
+	size_t			off;
+	uint64_t		val, v;
+	int			c;
+
+	off = (char *)rnode->sysctl_data - (char *)&est_cpu[0];
+	val = 0;
+	for (c = 0; c < ncpu; c++) {
+		v = *(uint64_t *)((char *)&est_cpu[c] + off);
+		if (rnode->sysctl_data == &est_cpu[0].ec_idle_lat_max ||
+		    (rnode->sysctl_data >= (void *)&est_cpu[0].ec_ov_max[0] &&
+		    rnode->sysctl_data <
+		    (void *)&est_cpu[0].ec_ov_max[EST_OV_N]))
+			val = MAX(val, v);
+		else
+			val += v;
+	}
+
+	node = *rnode;
+	node.sysctl_data = &val;
+	return sysctl_lookup(SYSCTLFN_CALL(&node));
+}
+
+/*
+ * Integer governor tunables: reject negative values and (re)start the
+ * sampling callout when an input gets enabled.
+ */
+static int
+est_sysctl_governor(SYSCTLFN_ARGS)
+{
+	struct sysctlnode	node;
+	int			val, error;
+
+	node = *rnode;
+	val = *(int *)rnode->sysctl_data;
+	node.sysctl_data = &val;
+
+	error = sysctl_lookup(SYSCTLFN_CALL(&node));
+	if (error || newp == NULL)
+		return error;
+
+	if (val < 0)
+		return EINVAL;
+	if ((rnode->sysctl_data == &est_sample_ms ||
+	    rnode->sysctl_data == &est_sample_min_ms ||
+	    rnode->sysctl_data == &est_sample_max_ms ||
+	    rnode->sysctl_data == &est_runq_probe_ms) && val == 0)
+		return EINVAL;
+	if (rnode->sysctl_data == &est_ewma_alpha && (val == 0 || val > 100))
+		return EINVAL;
+	if (rnode->sysctl_data == &est_nice_share && val > 100)
+		return EINVAL;
+	if (rnode->sysctl_data == &est_therm_enable && val != 0 &&
+	    (cpu_feature & CPUID_ACPI) == 0)
+		return EOPNOTSUPP;
+	if (rnode->sysctl_data == &est_pmc_enable && val != 0 &&
+	    !est_pmc_p6())
+		return EOPNOTSUPP;
+	if (rnode->sysctl_data == &phc_mca_enable && val != 0 &&
+	    phc_mca_nbanks == 0)
+		return EOPNOTSUPP;
+	if (rnode->sysctl_data == &est_idle_enable && val != 0) {
+		mutex_enter(&est_lock);
+		error = est_idle_check();
+		mutex_exit(&est_lock);
+		if (error)
+			return error;
+	}
+
+	/* the counters are started and stopped outside est_lock */
+	if (rnode->sysctl_data == &est_pmc_enable &&
+	    (val != 0) != (est_pmc_enable != 0))
+		xc_wait(xc_broadcast(0, est_xc_pmc,
+		    val != 0 ? &val : NULL, NULL));
+
+	mutex_enter(&est_lock);
+	*(int *)rnode->sysctl_data = val;
+	if (rnode->sysctl_data == &est_sample_ms ||
+	    rnode->sysctl_data == &est_adapt_enable)
+		est_sample_cur_ms = est_sample_ms;
+	if (rnode->sysctl_data == &est_therm_enable && val == 0) {
+		est_therm_state = 0;
+		est_apply();
+	}
+	if (rnode->sysctl_data == &est_pb_budget)
+		est_pb_credit = 0;
+	if (rnode->sysctl_data == &est_runq_enable && val == 0) {
+		est_runq_floor = est_fqlist->n - 1;
+		est_apply();
+	}
+	if (rnode->sysctl_data == &est_runq_enable && val != 0) {
+		est_runq_busy = true;
+		callout_schedule(&est_runq_ch,
+		    MAX(mstohz(est_runq_probe_ms), 1));
+	}
+	if (rnode->sysctl_data == &est_idle_enable)
+		est_idle_hook(est_idle_enable || est_race_enable);
+	if (rnode->sysctl_data == &est_boost_mhz)
+		est_boost_state = val == 0 ? 0 : est_freq_to_state(val);
+	if (rnode->sysctl_data == &est_nice_mhz)
+		est_nice_target = val == 0 ?
+		    (int)est_fqlist->n - 1 : est_freq_to_state(val);
+	if (rnode->sysctl_data == &est_nice_enable && val == 0) {
+		est_nice_state = 0;
+		est_apply();
+	}
+	if (rnode->sysctl_data == &est_boost_enable && val == 0) {
+		est_boost_floor = est_fqlist->n - 1;
+		est_apply();
+	}
+	if (rnode->sysctl_data == &est_idle_mhz)
+		est_idle_state = val == 0 ?
+		    (int)est_fqlist->n - 1 : est_freq_to_state(val);
+	if ((rnode->sysctl_data == &est_pmc_enable ||
+	    rnode->sysctl_data == &est_ipc_threshold) && val == 0) {
+		est_ipc_state = 0;
+		est_apply();
+	}
+	mutex_exit(&est_lock);
+
+	est_sample_schedule();
+	return 0;
+}
+
+/*
+ * Restrict the usable frequencies to [min_mhz, max_mhz].  A value of 0
+ * leaves the corresponding bound unrestricted.  May sleep.
+ */
+int
+est_set_limits(int max_mhz, int min_mhz)
+{
+	int			max, min, error;
+
+	if (est_fqlist == NULL)
+		return EOPNOTSUPP;
+
+	max = 0;
+	if (max_mhz > 0) {
+		max = est_freq_to_state(max_mhz);
+		if (MSR2MHZ(est_fqlist->table[max], bus_clock) > max_mhz &&
+		    max < (int)est_fqlist->n - 1)
+			max++;
+	}
+	min = est_fqlist->n - 1;
+	if (min_mhz > 0)
+		min = est_freq_to_state(min_mhz);
+
+	mutex_enter(&est_lock);
+	error = est_update_limits(max, min);
+	mutex_exit(&est_lock);
+
+	return error;
+}
+
+static int
+est_sysctl_helper(SYSCTLFN_ARGS)
+{
+	struct sysctlnode	node;
+	int			fq, oldfq, error;
+
+	if (est_fqlist == NULL)
+		return EOPNOTSUPP;
+
+	node = *rnode;
+	node.sysctl_data = &fq;
+
+	oldfq = 0;
+	if (rnode->sysctl_num == est_node_target && est_pending_state >= 0)
+		fq = oldfq = MSR2MHZ(est_fqlist->table[est_pending_state],
+		    bus_clock);
+	else if (rnode->sysctl_num == est_node_target)
+		fq = oldfq = MSR2MHZ(EST_CURCPU()->ec_perf_ctl, bus_clock);
+	else if (rnode->sysctl_num == est_node_current && est_current_rdmsr)
+		fq = MSR2MHZ(rdmsr(MSR_PERF_STATUS), bus_clock);
+	else if (rnode->sysctl_num == est_node_current)
+		fq = MSR2MHZ(EST_CURCPU()->ec_perf_ctl, bus_clock);
+	else if (rnode->sysctl_num == est_node_max)
+		fq = oldfq =
+		    MSR2MHZ(est_fqlist->table[est_state_max], bus_clock);
+	else if (rnode->sysctl_num == est_node_min)
+		fq = oldfq =
+		    MSR2MHZ(est_fqlist->table[est_state_min], bus_clock);
+	else
+		return EOPNOTSUPP;
+
+	error = sysctl_lookup(SYSCTLFN_CALL(&node));
+	if (error || newp == NULL)
+		return error;
+
+	/*
+	 * The target shown is the programmed state, which a cap or floor
+	 * may hold away from the request: compare with the request.
+	 */
+	if (rnode->sysctl_num == est_node_target)
+		oldfq = MSR2MHZ(est_fqlist->table[est_pending_state >= 0 ?
+		    est_pending_state : est_req_state], bus_clock);
+	if (fq == oldfq)
+		return 0;
+
+	/* support writing to ...frequency.{max,min} */
+	if (rnode->sysctl_num == est_node_max)
+		return est_set_limits(fq,
+		    MSR2MHZ(est_fqlist->table[est_state_min], bus_clock));
+	if (rnode->sysctl_num == est_node_min)
+		return est_set_limits(
+		    MSR2MHZ(est_fqlist->table[est_state_max], bus_clock), fq);
+
+	/* the other governors and a lease own the target */
+	if (rnode->sysctl_num == est_node_target &&
+	    (est_gov != &est_gov_userspace || est_lease_state >= 0))
+		return EBUSY;
+
+	/* support writing to ...frequency.target */
+	if (rnode->sysctl_num == est_node_target) {
+		mutex_enter(&est_lock);
+		if (est_coalesce_ms > 0) {
+			/* a later write supersedes a pending one */
+			if (est_pending_state >= 0) {
+				est_stat_coalesced++;
+				est_shm_update();
+			} else
+				callout_schedule(&est_coalesce_ch,
+				    mstohz(est_coalesce_ms));
+			est_pending_state = est_freq_to_state(fq);
+		} else {
+			/* a pending write is older than this one */
+			est_coalesce_stop(false);
+			est_req_state = est_freq_to_state(fq);
+			est_apply();
+			est_stat_applied++;
+		}
+		mutex_exit(&est_lock);
+	}
+
+	return 0;
+}
+
+/* ARGSUSED */
+static void
+est_xc_snapshot(void *arg1, void *arg2)
+{
+	struct est_snapshot	*es;
+	uint64_t		status;
+	u_int			idx;
+	int			i;
+
+	idx = cpu_index(curcpu());
+	if (idx >= *(u_int *)arg2)
+		return;
+
+	status = rdmsr(MSR_PERF_STATUS);
+	es = (struct est_snapshot *)arg1 + idx;
+	es->es_cpu = idx;
+	es->es_fid = MSR2FREQINC(status);
+	es->es_vid = MSR2VOLTINC(status);
+	es->es_perf_ctl = rdmsr(MSR_PERF_CTL) & 0xffff;
+	es->es_mhz = MSR2MHZ(status, bus_clock);
+	es->es_mv = MSR2MV(status);
+	es->es_state = -1;
+	for (i = 0; i < est_fqlist->n; i++)
+		if (est_fqlist->table[i] == (status & 0xffff))
+			es->es_state = i;
+}
+
+/*
+ * machdep.est.snapshot: PERF_STATUS/PERF_CTL of every CPU at once.
+ */
+static int
+est_sysctl_snapshot(SYSCTLFN_ARGS)
+{
+	struct sysctlnode	node;
+	struct est_snapshot	*buf;
+	size_t			size;
+	u_int			n;
+	int			error;
+
+	if (est_fqlist == NULL)
+		return EOPNOTSUPP;
+
+	n = ncpu;
+	size = n * sizeof(*buf);
+	buf = kmem_zalloc(size, KM_SLEEP);
+	if (buf == NULL)
+		return ENOMEM;
+
+	/* a size probe does not need the cross-call */
+	if (oldp != NULL)
+		xc_wait(xc_broadcast(0, est_xc_snapshot, buf, &n));
+
+	node = *rnode;
+	node.sysctl_data = buf;
+	node.sysctl_size = size;
+	error = sysctl_lookup(SYSCTLFN_CALL(&node));
+
+	kmem_free(buf, size);
+	return error;
+}
+
+/*
+ * Wake up the kevent listeners of /dev/est.  Called with est_lock held.
+ */
+static void
+est_notify(long hint)
+{
+	KASSERT(mutex_owned(&est_lock));
+
+	selnotify(&est_sel, 0, hint);
+}
+
+/*
+ * Publish est_cpu[] and the counters in the telemetry page, charging
+ * the time spent in the previous state of each CPU that changed state.
+ * Called with est_lock held.
+ */
+static void
+est_shm_update(void)
+{
+	struct est_shm_cpu	*esc;
+	struct timespec		ts;
+	uint64_t		now;
+	u_int			c, state;
+
+	KASSERT(mutex_owned(&est_lock));
+
+	if (est_shm == NULL)
+		return;
+
+	nanouptime(&ts);
+	now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+	est_shm->es_seq++;
+	membar_producer();
+
+	for (c = 0; c < MAXCPUS; c++) {
+		esc = &est_shm->es_cpu[c];
+		state = est_cpu[c].ec_state;
+		if (state != esc->esc_state) {
+			if (esc->esc_state < EST_SHM_MAXSTATES)
+				esc->esc_residency[esc->esc_state] +=
+				    now - esc->esc_entered;
+			esc->esc_state = state;
+			esc->esc_entered = now;
+			esc->esc_transitions++;
+		}
+		esc->esc_mhz = MSR2MHZ(est_cpu[c].ec_perf_ctl, bus_clock);
+		esc->esc_mv = MSR2MV(est_cpu[c].ec_perf_ctl);
+		esc->esc_idle = est_cpu[c].ec_idle_low;
+		esc->esc_idle_ns = est_cpu[c].ec_idle_time_ns;
+	}
+	est_shm->es_ncpu = ncpu;
+	est_shm->es_applied = est_stat_applied;
+	est_shm->es_coalesced = est_stat_coalesced;
+	est_shm->es_xcalls = est_stat_xcalls;
+
+	membar_producer();
+	est_shm->es_seq++;
+}
+
+/* ARGSUSED */
+int
+estopen(dev_t dev, int flag, int mode, struct lwp *l)
+{
+	if (est_fqlist == NULL)
+		return ENXIO;
+	return 0;
+}
+
+/* ARGSUSED */
+int
+estclose(dev_t dev, int flag, int mode, struct lwp *l)
+{
+	/* last close: nobody is left to release the lease or requests */
+	mutex_enter(&est_lock);
+	if (est_lease_state >= 0)
+		est_lease_release();
+	mutex_exit(&est_lock);
+
+	return est_qos_proc(NULL, 0);
+}
+
+/* ARGSUSED */
+int
+estioctl(dev_t dev, u_long cmd, void *data, int flag, struct lwp *l)
+{
+	struct est_lease	*el = data;
+	int			error = 0;
+
+	switch (cmd) {
+	case ESTIOC_LEASE:
+		if ((flag & FWRITE) == 0)
+			return EBADF;
+		if (el->el_state < 0 || el->el_state >= (int)est_fqlist->n ||
+		    el->el_ms <= 0 || el->el_ms > EST_LEASE_MAX_MS)
+			return EINVAL;
+
+		mutex_enter(&est_lock);
+		if (est_lease_state >= 0 && est_lease_proc != l->l_proc) {
+			error = EBUSY;
+		} else {
+			if (est_lease_state < 0) {
+				/* the lease overrides any pending write */
+				est_coalesce_stop(false);
+				est_lease_capped = false;
+				if (cpu_feature & CPUID_ACPI)
+					xc_wait(xc_broadcast(0,
+					    est_xc_therm_log, el, NULL));
+			}
+			est_lease_state = est_lease_clamp(el->el_state);
+			est_lease_proc = l->l_proc;
+			est_lease_end = hardclock_ticks + mstohz(el->el_ms);
+			callout_schedule(&est_lease_ch, mstohz(el->el_ms));
+			est_apply();
+		}
+		est_lease_stat(el);
+		mutex_exit(&est_lock);
+		break;
+
+	case ESTIOC_UNLEASE:
+		mutex_enter(&est_lock);
+		if (est_lease_state >= 0 && est_lease_proc != l->l_proc)
+			error = EPERM;
+		else {
+			if (est_lease_state >= 0)
+				est_lease_release();
+			est_lease_stat(el);
+		}
+		mutex_exit(&est_lock);
+		break;
+
+	case ESTIOC_LEASESTAT:
+		mutex_enter(&est_lock);
+		est_lease_stat(el);
+		mutex_exit(&est_lock);
+		break;
+
+	case ESTIOC_QOS:
+		if ((flag & FWRITE) == 0)
+			return EBADF;
+		error = est_qos_proc(l->l_proc, *(int *)data);
+		break;
+
+	default:
+		error = ENOTTY;
+	}
+
+	return error;
+}
+
+/* ARGSUSED */
+paddr_t
+estmmap(dev_t dev, off_t off, int prot)
+{
+	paddr_t			pa;
+
+	if (est_shm == NULL || off < 0 || off >= EST_SHM_SIZE ||
+	    (prot & VM_PROT_WRITE) != 0)
+		return -1;
+
+	if (!pmap_extract(pmap_kernel(), (vaddr_t)est_shm + off, &pa))
+		return -1;
+
+	return x86_btop(pa);
+}
+
+static void
+filt_estdetach(struct knote *kn)
+{
+	mutex_enter(&est_lock);
+	SLIST_REMOVE(&est_sel.sel_klist, kn, knote, kn_selnext);
+	mutex_exit(&est_lock);
+}
+
+static int
+filt_estevent(struct knote *kn, long hint)
+{
+	if (hint != 0) {
+		kn->kn_fflags |= hint;
+		kn->kn_data++;
+	}
+	return kn->kn_data != 0;
+}
+
+/* ARGSUSED */
+int
+estkqfilter(dev_t dev, struct knote *kn)
+{
+	switch (kn->kn_filter) {
+	case EVFILT_READ:
+		kn->kn_fop = &est_filtops;
+		break;
+	default:
+		return EINVAL;
+	}
+
+	mutex_enter(&est_lock);
+	SLIST_INSERT_HEAD(&est_sel.sel_klist, kn, kn_selnext);
+	mutex_exit(&est_lock);
+
+	return 0;
+}
+
+/*
+ * Modelled power in mW of a CPU running PERF_CTL/PERF_STATUS value msr.
+ */
+static uint64_t
+est_power_mw(uint16_t msr)
+{
+	return est_model_power_mw(est_ceff_pf, msr, bus_clock);
+}
+
+/* ARGSUSED */
+static void
+est_xc_perf_status(void *arg1, void *arg2)
+{
+	*(uint16_t *)arg1 = rdmsr(MSR_PERF_STATUS) & 0xffff;
+}
+
+static void
+est_sensor_refresh(struct sysmon_envsys *sme, envsys_data_t *edata)
+{
+	struct cpu_info		*ci;
+	uint16_t		msr;
+	u_int			c;
+
+	c = edata->sensor / EST_NSENSORS;
+	ci = cpu_lookup(c);
+	if (est_fqlist == NULL || ci == NULL) {
+		edata->state = ENVSYS_SINVALID;
+		return;
+	}
+
+	xc_wait(xc_unicast(0, est_xc_perf_status, &msr, NULL, ci));
+
+	switch (edata->sensor % EST_NSENSORS) {
+	case EST_SENSOR_MHZ:
+		edata->value_cur = MSR2MHZ(msr, bus_clock);
+		break;
+	case EST_SENSOR_VOLT:
+		edata->value_cur = MSR2MV(msr) * 1000;		/* uV */
+		break;
+	case EST_SENSOR_POWER:
+		edata->value_cur = est_power_mw(msr) * 1000;	/* uW */
+		break;
+	}
+	edata->state = ENVSYS_SVALID;
+}
+
+/*
+ * Per-CPU setup, run through config_finalize_register() so that every
+ * CPU is known.
+ */
+/* ARGSUSED */
+static int
+est_finalize(device_t self)
+{
+	static bool		done;
+
+	if (done || est_fqlist == NULL)
+		return 0;
+	done = true;
+
+	/* PHC: bring the boot VID list to the application processors */
+	if (phc_boot_applied) {
+		mutex_enter(&est_lock);
+		est_set_state(EST_CURCPU()->ec_state);
+		phc_boot_applied = false;
+		mutex_exit(&est_lock);
+	}
+
+	if (est_cpu_sysctl_init() != 0)
+		aprint_error("%s: unable to create machdep.est.cpuN\n",
+		    __func__);
+	est_sensor_init();
+
+	return 0;
+}
+
+/*
+ * Setup the sysctl sub-trees machdep.est.cpuN.*
+ */
+static int
+est_cpu_sysctl_init(void)
+{
+	const struct sysctlnode	*node, *ovnode;
+	char			name[32];
+	int			c, i, rc;
+
+	for (c = 0; c < ncpu && c < MAXCPUS; c++) {
+		snprintf(name, sizeof(name), "cpu%d", c);
+		if ((rc = sysctl_createv(NULL, 0, NULL, &node,
+		    0, CTLTYPE_NODE, name, NULL,
+		    NULL, 0, NULL, 0,
+		    CTL_MACHDEP, est_node_root, CTL_CREATE, CTL_EOL)) != 0)
+			return rc;
+
+		if ((rc = sysctl_createv(NULL, 0, &node, NULL,
+		    0, CTLTYPE_INT, "effective_mhz",
+		    SYSCTL_DESCR("Unhalted cycles per busy us (governor.pmc)"),
+		    NULL, 0, &est_cpu[c].ec_eff_mhz, 0,
+		    CTL_CREATE, CTL_EOL)) != 0)
+			return rc;
+
+		if ((rc = sysctl_createv(NULL, 0, &node, &ovnode,
+		    0, CTLTYPE_NODE, "overhead",
+		    SYSCTL_DESCR("Cycles spent by the driver on this CPU"),
+		    NULL, 0, NULL, 0, CTL_CREATE, CTL_EOL)) != 0)
+			return rc;
+
+		for (i = 0; i < EST_OV_N; i++) {
+			if ((rc = sysctl_createv(NULL, 0, &ovnode, NULL,
+			    0, CTLTYPE_QUAD, est_ov_names[i],
+			    SYSCTL_DESCR("Total cycles"),
+			    NULL, 0, &est_cpu[c].ec_ov[i], 0,
+			    CTL_CREATE, CTL_EOL)) != 0)
+				return rc;
+
+			snprintf(name, sizeof(name), "%s_max",
+			    est_ov_names[i]);
+			if ((rc = sysctl_createv(NULL, 0, &ovnode, NULL,
+			    0, CTLTYPE_QUAD, name,
+			    SYSCTL_DESCR("Longest single run, cycles"),
+			    NULL, 0, &est_cpu[c].ec_ov_max[i], 0,
+			    CTL_CREATE, CTL_EOL)) != 0)
+				return rc;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Register the envsys sensors.
+ */
+static int
+est_sensor_init(void)
+{
+	envsys_data_t		*edata;
+	int			c, i;
+
+	est_nsensor = ncpu * EST_NSENSORS;
+	est_sensor = kmem_zalloc(est_nsensor * sizeof(*est_sensor), KM_SLEEP);
+	if (est_sensor == NULL)
+		return 0;
+
+	est_sme = sysmon_envsys_create();
+	for (i = 0; i < est_nsensor; i++) {
+		edata = &est_sensor[i];
+		c = i / EST_NSENSORS;
+		switch (i % EST_NSENSORS) {
+		case EST_SENSOR_MHZ:
+			edata->units = ENVSYS_INTEGER;
+			snprintf(edata->desc, sizeof(edata->desc),
+			    "cpu%d frequency (MHz)", c);
+			break;
+		case EST_SENSOR_VOLT:
+			edata->units = ENVSYS_SVOLTS_DC;
+			snprintf(edata->desc, sizeof(edata->desc),
+			    "cpu%d core voltage", c);
+			break;
+		case EST_SENSOR_POWER:
+			edata->units = ENVSYS_SWATTS;
+			snprintf(edata->desc, sizeof(edata->desc),
+			    "cpu%d modelled power", c);
+			break;
+		}
+		edata->state = ENVSYS_SINVALID;
+		if (sysmon_envsys_sensor_attach(est_sme, edata) != 0)
+			goto err;
+	}
+
+	est_sme->sme_name = "est";
+	est_sme->sme_cookie = NULL;
+	est_sme->sme_refresh = est_sensor_refresh;
+	if (sysmon_envsys_register(est_sme) != 0)
+		goto err;
+
+	return 0;
+
+ err:
+	aprint_error("%s: unable to register envsys sensors\n", __func__);
+	sysmon_envsys_destroy(est_sme);
+	est_sme = NULL;
+	kmem_free(est_sensor, est_nsensor * sizeof(*est_sensor));
+	est_sensor = NULL;
+	return 0;
+}
+
+static int
+est_init_once(void)
+{
+	est_init_main(lvendor);
+	return 0;
+}
+
+void
+est_init(int vendor)
+{
+	int error;
+	static ONCE_DECL(est_initialized);
+
+	lvendor = vendor;
+
+	error = RUN_ONCE(&est_initialized, est_init_once);
+	if (__predict_false(error != 0))
+		return;
 }
 
 static void
@@ -1212,11 +4056,12 @@ est_init_main(int vendor)
 	uint8_t			crhi, crlo, crcur;
 	int			i, mv, rc;
 	size_t			len, freq_len;
-	char			*freq_names;
+	char			*freq_names, name[32];
 	const char *cpuname;
-	const struct sysctlnode	*voltnode;
+	const struct sysctlnode	*voltnode, *statsnode, *govnode, *ovnode;
 	size_t			vids_len,fids_len;
 	char			*phc_original_vids,*phc_fids;
+	devmajor_t		bmajor, cmajor;
 
 	cpuname	= device_xname(curcpu()->ci_dev);
 
@@ -1388,8 +4233,92 @@ est_init_main(int vendor)
 		est_fqlist = &fake_fqlist;
 	}
 
+	mutex_init(&est_lock, MUTEX_DEFAULT, IPL_NONE);
+	est_state_max = 0;
+	est_state_min = est_fqlist->n - 1;
+
+	cur = rdmsr(MSR_PERF_CTL) & 0xffff;
+	for (i = 0; i < MAXCPUS; i++) {
+		est_cpu[i].ec_perf_ctl = cur;
+		est_cpu[i].ec_state =
+		    est_freq_to_state(MSR2MHZ(cur, bus_clock));
+	}
+	est_req_state = est_cpu[0].ec_state;
+	est_idle_state = est_fqlist->n - 1;
+	est_runq_floor = est_fqlist->n - 1;
+	est_boost_floor = est_fqlist->n - 1;
+	est_qos_floor = est_fqlist->n - 1;
+	est_nice_target = est_fqlist->n - 1;
+
+	est_governor_register(&est_gov_racetoidle);
+	est_governor_register(&est_gov_predictive);
+	est_governor_register(&est_gov_powerbudget);
+	est_governor_register(&est_gov_userspace);
+	est_gov = &est_gov_userspace;
+
+	est_shm = (struct est_shm *)uvm_km_alloc(kernel_map, EST_SHM_SIZE, 0,
+	    UVM_KMF_WIRED | UVM_KMF_ZERO);
+	if (est_shm != NULL) {
+		struct timespec ts;
+
+		nanouptime(&ts);
+		est_shm->es_version = EST_SHM_VERSION;
+		est_shm->es_nstates = MIN(est_fqlist->n, EST_SHM_MAXSTATES);
+		for (i = 0; i < MAXCPUS; i++) {
+			est_shm->es_cpu[i].esc_state = est_cpu[i].ec_state;
+			est_shm->es_cpu[i].esc_entered =
+			    (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+		}
+		mutex_enter(&est_lock);
+		est_shm_update();
+		mutex_exit(&est_lock);
+	}
+
+	config_finalize_register(curcpu()->ci_dev, est_finalize);
+
+	selinit(&est_sel);
+	bmajor = cmajor = -1;
+	if (devsw_attach("est", NULL, &bmajor, &est_cdevsw, &cmajor) != 0)
+		aprint_error("%s: unable to attach /dev/est\n", __func__);
+	else
+		aprint_normal("%s: %s event device major %d\n",
+		    cpuname, est_desc, cmajor);
+
+	callout_init(&est_coalesce_ch, CALLOUT_MPSAFE);
+	callout_setfunc(&est_coalesce_ch, est_coalesce_tick, NULL);
+	callout_init(&est_sample_ch, CALLOUT_MPSAFE);
+	callout_setfunc(&est_sample_ch, est_sample_tick, NULL);
+	callout_init(&est_boost_ch, CALLOUT_MPSAFE);
+	callout_setfunc(&est_boost_ch, est_boost_tick, NULL);
+	callout_init(&est_lease_ch, CALLOUT_MPSAFE);
+	callout_setfunc(&est_lease_ch, est_lease_tick, NULL);
+	callout_init(&est_runq_ch, CALLOUT_MPSAFE);
+	callout_setfunc(&est_runq_ch, est_runq_tick, NULL);
+	est_exithook = exithook_establish(est_proc_exit, NULL);
+	/* IPL_VM: est_boost() queues work from interrupt handlers */
+	if (workqueue_create(&est_wq, "est", est_work, NULL,
+	    PRI_NONE, IPL_VM, WQ_MPSAFE) != 0) {
+		aprint_error("%s: unable to create workqueue\n", __func__);
+		est_fqlist = NULL;
+		return;
+	}
+
 	/* PHC: keep original setting in memory */
-	memcpy( &phc_origin_table, &fake_table, sizeof(fake_table));
+	phc_origin_table = malloc(est_fqlist->n * sizeof(uint16_t), M_DEVBUF,
+	    M_WAITOK);
+	memcpy(phc_origin_table, fake_table, est_fqlist->n * sizeof(uint16_t));
+
+	/* PHC: machine-check guard */
+	phc_mca_errors = kmem_zalloc(est_fqlist->n * sizeof(uint64_t),
+	    KM_SLEEP);
+	phc_mca_hit = kmem_zalloc(est_fqlist->n * sizeof(bool), KM_SLEEP);
+	phc_mca_new = kmem_zalloc(MAXCPUS * est_fqlist->n * sizeof(u_int),
+	    KM_SLEEP);
+	for (i = 0; i < MAXCPUS; i++)
+		est_cpu[i].ec_mca_new = &phc_mca_new[i * est_fqlist->n];
+	if ((cpu_feature & CPUID_MCA) != 0)
+		phc_mca_nbanks = MIN((int)(rdmsr(MSR_MCG_CAP) & 0xff),
+		    PHC_MCA_MAXBANKS);
 
 	/*
 	 * OK, tell the user the available frequencies.
@@ -1437,7 +4366,10 @@ est_init_main(int vendor)
 
 	/* PHC: create initial VIDs by copying original ones */
 	phc_string_vids = kmem_alloc( PHC_MAXLEN, KM_SLEEP);
-	strlcpy( phc_string_vids, phc_original_vids, vids_len);
+	strlcpy( phc_string_vids, phc_original_vids, PHC_MAXLEN);
+
+	/* PHC: apply VIDs given at boot, before the sysctl tree exists */
+	phc_boot_vids();
 
 	/*
 	 * Setup the sysctl sub-tree machdep.est.*
@@ -1451,6 +4383,7 @@ est_init_main(int vendor)
 	    0, CTLTYPE_NODE, "est", NULL,
 	    NULL, 0, NULL, 0, CTL_CREATE, CTL_EOL)) != 0)
 		goto err;
+	est_node_root = estnode->sysctl_num;
 
 	if ((rc = sysctl_createv(NULL, 0, &estnode, &freqnode,
 	    0, CTLTYPE_NODE, "frequency", NULL,
@@ -1474,6 +4407,458 @@ est_init_main(int vendor)
 	    NULL, 0, freq_names, freq_len, CTL_CREATE, CTL_EOL)) != 0)
 		goto err;
 
+	if ((rc = sysctl_createv(NULL, 0, &freqnode, &node,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "max",
+	    SYSCTL_DESCR("Highest frequency the driver may program"),
+	    est_sysctl_helper, 0, NULL, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+	est_node_max = node->sysctl_num;
+
+	if ((rc = sysctl_createv(NULL, 0, &freqnode, &node,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "min",
+	    SYSCTL_DESCR("Lowest frequency the driver may program"),
+	    est_sysctl_helper, 0, NULL, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+	est_node_min = node->sysctl_num;
+
+	if ((rc = sysctl_createv(NULL, 0, &freqnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "current_rdmsr",
+	    SYSCTL_DESCR("Read current from PERF_STATUS instead of the cache"),
+	    NULL, 0, &est_current_rdmsr, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &freqnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "coalesce_ms",
+	    SYSCTL_DESCR("Delay target writes to merge bursts (0 = off)"),
+	    est_sysctl_coalesce, 0, &est_coalesce_ms, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &freqnode, NULL,
+	    0, CTLTYPE_INT, "qos_min",
+	    SYSCTL_DESCR("Highest minimum-frequency request (0 = none)"),
+	    NULL, 0, &est_qos_mhz, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &freqnode, NULL,
+	    0, CTLTYPE_INT, "qos_requests",
+	    SYSCTL_DESCR("Active minimum-frequency requests"),
+	    NULL, 0, &est_qos_nreq, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &estnode, NULL,
+	    0, CTLTYPE_STRUCT, "snapshot",
+	    SYSCTL_DESCR("Frequency and voltage of every CPU"),
+	    est_sysctl_snapshot, 0, NULL, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &estnode, &node,
+	    0, CTLTYPE_NODE, "power", NULL,
+	    NULL, 0, NULL, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &node, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "ceff_pf",
+	    SYSCTL_DESCR("Effective capacitance of the power model (pF)"),
+	    NULL, 0, &est_ceff_pf, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &estnode, &govnode,
+	    0, CTLTYPE_NODE, "governor", NULL,
+	    NULL, 0, NULL, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, &node,
+	    CTLFLAG_READWRITE, CTLTYPE_STRING, "current",
+	    SYSCTL_DESCR("Governor choosing the frequency"),
+	    est_sysctl_govname, 0, NULL, EST_GOV_NAMELEN,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+	est_node_gov_current = node->sysctl_num;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    0, CTLTYPE_STRING, "available",
+	    SYSCTL_DESCR("Registered governors"),
+	    est_sysctl_govname, 0, NULL, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "interval_ms",
+	    SYSCTL_DESCR("Governor sampling period"),
+	    est_sysctl_governor, 0, &est_sample_ms, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "adaptive",
+	    SYSCTL_DESCR("Adapt the sampling period to the load"),
+	    est_sysctl_governor, 0, &est_adapt_enable, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "interval_min_ms",
+	    SYSCTL_DESCR("Shortest adaptive sampling period"),
+	    est_sysctl_governor, 0, &est_sample_min_ms, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "interval_max_ms",
+	    SYSCTL_DESCR("Longest adaptive sampling period"),
+	    est_sysctl_governor, 0, &est_sample_max_ms, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    0, CTLTYPE_INT, "interval_cur_ms",
+	    SYSCTL_DESCR("Current sampling period"),
+	    NULL, 0, &est_sample_cur_ms, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    0, CTLTYPE_INT, "wakeups_per_sec",
+	    SYSCTL_DESCR("Governor callout wakeups per second x100"),
+	    NULL, 0, &est_wake_rate, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "ewma_alpha",
+	    SYSCTL_DESCR("predictive: weight of the newest sample (%)"),
+	    est_sysctl_governor, 0, &est_ewma_alpha, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "ewma_period",
+	    SYSCTL_DESCR("predictive: detect periodic load"),
+	    est_sysctl_governor, 0, &est_ewma_period, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "thermal",
+	    SYSCTL_DESCR("Step down before the thermal throttle trips"),
+	    est_sysctl_governor, 0, &est_therm_enable, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "thermal_margin",
+	    SYSCTL_DESCR("Step down this many degrees below TjMax"),
+	    est_sysctl_governor, 0, &est_therm_margin, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "thermal_hysteresis",
+	    SYSCTL_DESCR("Degrees to cool down before stepping back up"),
+	    est_sysctl_governor, 0, &est_therm_hyst, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "thermal_holdoff",
+	    SYSCTL_DESCR("Cool samples required before stepping back up"),
+	    est_sysctl_governor, 0, &est_therm_holdoff, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    0, CTLTYPE_INT, "thermal_steps",
+	    SYSCTL_DESCR("States removed by the thermal input"),
+	    NULL, 0, &est_therm_state, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "power_budget_mw",
+	    SYSCTL_DESCR("Average modelled power for powerbudget (mW)"),
+	    est_sysctl_governor, 0, &est_pb_budget, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    0, CTLTYPE_INT, "power_mw",
+	    SYSCTL_DESCR("Modelled power over the last sample"),
+	    NULL, 0, &est_pb_power, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "pmc",
+	    SYSCTL_DESCR("Step down during memory-bound phases"),
+	    est_sysctl_governor, 0, &est_pmc_enable, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "ipc_threshold",
+	    SYSCTL_DESCR("Instructions per 100 cycles to step down below"),
+	    est_sysctl_governor, 0, &est_ipc_threshold, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "ipc_hysteresis",
+	    SYSCTL_DESCR("IPC x100 above the threshold to step back up"),
+	    est_sysctl_governor, 0, &est_ipc_hyst, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    0, CTLTYPE_INT, "ipc",
+	    SYSCTL_DESCR("Lowest IPC x100 of the busy CPUs"),
+	    NULL, 0, &est_ipc_last, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    0, CTLTYPE_INT, "ipc_steps",
+	    SYSCTL_DESCR("States removed by the IPC input"),
+	    NULL, 0, &est_ipc_state, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    0, CTLTYPE_QUAD, "ipc_down",
+	    SYSCTL_DESCR("Steps down taken by the IPC input"),
+	    NULL, 0, &est_stat_ipc_down, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    0, CTLTYPE_QUAD, "ipc_up",
+	    SYSCTL_DESCR("Steps back up taken by the IPC input"),
+	    NULL, 0, &est_stat_ipc_up, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "runq",
+	    SYSCTL_DESCR("Go to the top state while threads are queued"),
+	    est_sysctl_governor, 0, &est_runq_enable, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "runq_probe_ms",
+	    SYSCTL_DESCR("Run queue probe period in ms"),
+	    est_sysctl_governor, 0, &est_runq_probe_ms, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "nice",
+	    SYSCTL_DESCR("Cap the frequency while only niced work runs"),
+	    est_sysctl_governor, 0, &est_nice_enable, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "nice_mhz",
+	    SYSCTL_DESCR("Frequency cap for niced work (0 = lowest)"),
+	    est_sysctl_governor, 0, &est_nice_mhz, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "nice_share",
+	    SYSCTL_DESCR("Niced share of busy time that is capped (%)"),
+	    est_sysctl_governor, 0, &est_nice_share, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "boost",
+	    SYSCTL_DESCR("Let input drivers boost the frequency"),
+	    est_sysctl_governor, 0, &est_boost_enable, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "boost_mhz",
+	    SYSCTL_DESCR("Frequency floor during a boost (0 = highest)"),
+	    est_sysctl_governor, 0, &est_boost_mhz, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "boost_ms",
+	    SYSCTL_DESCR("Duration of a boost"),
+	    est_sysctl_governor, 0, &est_boost_ms, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "boost_interval_ms",
+	    SYSCTL_DESCR("Minimum time between two boosts"),
+	    est_sysctl_governor, 0, &est_boost_interval_ms, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "idle",
+	    SYSCTL_DESCR("Drop to a low state while a CPU is idle"),
+	    est_sysctl_governor, 0, &est_idle_enable, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "idle_delay_ms",
+	    SYSCTL_DESCR("Idle time before dropping to the idle state"),
+	    est_sysctl_governor, 0, &est_idle_ms, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &govnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "idle_mhz",
+	    SYSCTL_DESCR("Frequency used while idle (0 = lowest)"),
+	    est_sysctl_governor, 0, &est_idle_mhz, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &estnode, &statsnode,
+	    0, CTLTYPE_NODE, "stats", NULL,
+	    NULL, 0, NULL, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "coalesced",
+	    SYSCTL_DESCR("Target writes superseded before being applied"),
+	    NULL, 0, &est_stat_coalesced, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "applied",
+	    SYSCTL_DESCR("Target writes applied to the CPUs"),
+	    NULL, 0, &est_stat_applied, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "xcalls",
+	    SYSCTL_DESCR("Cross-calls issued to program PERF_CTL"),
+	    NULL, 0, &est_stat_xcalls, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "transition_ns",
+	    SYSCTL_DESCR("Latency of the last frequency transition"),
+	    NULL, 0, &est_trans_ns, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "transition_ns_max",
+	    SYSCTL_DESCR("Longest frequency transition latency"),
+	    NULL, 0, &est_trans_max, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "governor_wakeups",
+	    SYSCTL_DESCR("Callout wakeups caused by the governor"),
+	    NULL, 0, __UNVOLATILE(&est_stat_wakeups), 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "thermal_down",
+	    SYSCTL_DESCR("Steps down taken by the thermal input"),
+	    NULL, 0, &est_stat_therm_down, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "thermal_up",
+	    SYSCTL_DESCR("Steps back up taken by the thermal input"),
+	    NULL, 0, &est_stat_therm_up, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "runq_boosts",
+	    SYSCTL_DESCR("Raises to the top state on queued threads"),
+	    NULL, 0, &est_stat_runq_boosts, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "nice_caps",
+	    SYSCTL_DESCR("Times the cap for niced work was applied"),
+	    NULL, 0, &est_stat_nice_caps, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "boosts",
+	    SYSCTL_DESCR("Boosts requested by input drivers"),
+	    NULL, 0, __UNVOLATILE(&est_stat_boosts), 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "boosts_ratelimited",
+	    SYSCTL_DESCR("Boosts dropped by the rate limit"),
+	    NULL, 0, __UNVOLATILE(&est_stat_boosts_limited), 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "idle_drops",
+	    SYSCTL_DESCR("Drops to the idle state"),
+	    est_sysctl_cpusum, 0, &est_cpu[0].ec_idle_drops, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "idle_time_ns",
+	    SYSCTL_DESCR("Time spent at the idle state"),
+	    est_sysctl_cpusum, 0, &est_cpu[0].ec_idle_time_ns, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "idle_restores",
+	    SYSCTL_DESCR("Restores on wakeup from the idle state"),
+	    est_sysctl_cpusum, 0, &est_cpu[0].ec_idle_restores, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "idle_restore_ns",
+	    SYSCTL_DESCR("Total wakeup latency added by restores"),
+	    est_sysctl_cpusum, 0, &est_cpu[0].ec_idle_lat_ns, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_QUAD, "idle_restore_ns_max",
+	    SYSCTL_DESCR("Longest wakeup latency added by a restore"),
+	    est_sysctl_cpusum, 0, &est_cpu[0].ec_idle_lat_max, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, &ovnode,
+	    0, CTLTYPE_NODE, "overhead",
+	    SYSCTL_DESCR("Cycles spent by the driver, all CPUs"),
+	    NULL, 0, NULL, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	for (i = 0; i < EST_OV_N; i++) {
+		if ((rc = sysctl_createv(NULL, 0, &ovnode, NULL,
+		    0, CTLTYPE_QUAD, est_ov_names[i],
+		    SYSCTL_DESCR("Total cycles"),
+		    est_sysctl_cpusum, 0, &est_cpu[0].ec_ov[i], 0,
+		    CTL_CREATE, CTL_EOL)) != 0)
+			goto err;
+
+		snprintf(name, sizeof(name), "%s_max", est_ov_names[i]);
+		if ((rc = sysctl_createv(NULL, 0, &ovnode, NULL,
+		    0, CTLTYPE_QUAD, name,
+		    SYSCTL_DESCR("Longest single run, cycles"),
+		    est_sysctl_cpusum, 0, &est_cpu[0].ec_ov_max[i], 0,
+		    CTL_CREATE, CTL_EOL)) != 0)
+			goto err;
+	}
+
+	if ((rc = sysctl_createv(NULL, 0, &statsnode, NULL,
+	    0, CTLTYPE_INT, "domains",
+	    SYSCTL_DESCR("Frequency domains written per transition"),
+	    NULL, 0, &est_ndomains, 0, CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
 	/* PHC: Adding a voltage subtree */
 	if ((rc = sysctl_createv(NULL, 0, &estnode, &voltnode,
 	    0, CTLTYPE_NODE, "phc", NULL,
@@ -1501,6 +4886,20 @@ est_init_main(int vendor)
 	    CTL_CREATE, CTL_EOL)) != 0)
 		goto err;
 
+	if ((rc = sysctl_createv(NULL, 0, &voltnode, NULL,
+	    CTLFLAG_READWRITE, CTLTYPE_INT, "mca",
+	    SYSCTL_DESCR("Raise a state's VID on corrected machine checks"),
+	    est_sysctl_governor, 0, &phc_mca_enable, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
+	if ((rc = sysctl_createv(NULL, 0, &voltnode, NULL,
+	    0, CTLTYPE_STRING, "mca_errors",
+	    SYSCTL_DESCR("Corrected machine checks per state"),
+	    phc_mca_sysctl_errors, 0, NULL, 0,
+	    CTL_CREATE, CTL_EOL)) != 0)
+		goto err;
+
 	return;
 
  err:
@@ -0,0 +1,385 @@
+/*	$NetBSD$	*/
+
+/*
+ * est_sim: replay a recorded load trace through the est(4) power model
+ * and governors, outside the kernel.
+ *
+ * A trace has one line per sampling interval holding the demand of each
+ * CPU, in per mille of the fastest state; '#' starts a comment.  Work
+ * that a slower state cannot serve within an interval is carried over
+ * to the next one and reported as backlog.  A halted CPU draws idle_mw
+ * at the voltage of the fastest state, scaled by V^2 (0 by default, as
+ * in the kernel model).
+ *
+ *	est_sim [-vx] [-b budget_mw] [-c ceff_pf] [-f mhz:mv,...]
+ *	    [-i idle_mw] [-p policy|all] [-t interval_ms] trace
+ *
+ * "-p all" replays the trace through every policy and compares their
+ * energy with the "ondemand" reference policy.  With -x the exit status
+ * is 2 when a policy that honours the budget exceeds it on average by
+ * more than EST_SIM_SLACK percent, for use as a test.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "est_model.h"
+
+#define MAXCPUS		32
+#define MAXSTATES	64
+#define BUS_CLOCK	10000		/* 100 MHz, in est(4) units */
+#define EST_SIM_SLACK	5		/* percent */
+#define OD_UP_THRESHOLD	800		/* per mille */
+#define OD_TARGET	700		/* per mille */
+
+static const char	*progname;
+
+struct sim {
+	uint16_t	table[MAXSTATES];	/* PERF_CTL values, fastest first */
+	int		nstates;
+	int		ncpu;
+	uint64_t	ceff_pf;
+	uint64_t	idle_mw;		/* halted, fastest state's V */
+	int		budget;			/* mW */
+	int		interval_ms;
+	int		verbose;
+
+	/* per-run state */
+	int		state;
+	uint16_t	cur[MAXCPUS];
+	int		util[MAXCPUS];		/* per mille, last interval */
+	uint64_t	backlog[MAXCPUS];	/* MHz x interval */
+	int64_t		credit;
+};
+
+struct sim_result {
+	uint64_t	energy_uj;
+	uint64_t	backlog_max;		/* MHz x interval */
+	uint64_t	backlog_end;
+	int		intervals;
+	int		over;			/* intervals above budget */
+};
+
+struct policy {
+	const char	*name;
+	/* state for the next interval, or -1 to keep the current one */
+	int		(*select)(struct sim *);
+	int		flags;
+#define POL_BUDGET	0x01		/* honours the power budget */
+#define POL_RACE	0x02		/* idles at the slowest state */
+};
+
+/*
+ * Reference policy, after the Linux "ondemand" cpufreq governor: jump
+ * to the fastest state when the busiest CPU is above OD_UP_THRESHOLD,
+ * otherwise take the slowest state that runs the largest demand at no
+ * more than OD_TARGET load.
+ */
+static int
+od_select(struct sim *s)
+{
+	uint64_t		demand, d;
+	int			c, i;
+
+	demand = 0;
+	for (c = 0; c < s->ncpu; c++) {
+		if (s->util[c] > OD_UP_THRESHOLD)
+			return 0;
+		d = (uint64_t)s->util[c] * MSR2MHZ(s->cur[c], BUS_CLOCK);
+		if (d > demand)
+			demand = d;
+	}
+	for (i = s->nstates - 1; i > 0; i--)
+		if ((uint64_t)MSR2MHZ(s->table[i], BUS_CLOCK) * OD_TARGET >=
+		    demand)
+			break;
+	return i;
+}
+
+static int
+pb_select(struct sim *s)
+{
+	uint64_t		power;
+
+	if (s->budget == 0)
+		return -1;
+	return est_model_pb_select(s->table, s->nstates, BUS_CLOCK,
+	    s->ceff_pf, s->cur, s->util, s->ncpu, s->budget, &s->credit,
+	    &power);
+}
+
+/*
+ * "racetoidle": the fastest state while busy, the slowest one while
+ * halted (POL_RACE).
+ */
+/* ARGSUSED */
+static int
+race_select(struct sim *s)
+{
+	return 0;
+}
+
+/* the first entry is the reference of "-p all" */
+static const struct policy policies[] = {
+	{ "ondemand",		od_select,	0 },
+	{ "powerbudget",	pb_select,	POL_BUDGET },
+	{ "racetoidle",		race_select,	POL_RACE },
+};
+#define NPOLICIES	(sizeof(policies) / sizeof(policies[0]))
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-vx] [-b budget_mw] [-c ceff_pf] "
+	    "[-f mhz:mv,...] [-i idle_mw] [-p policy|all] "
+	    "[-t interval_ms] trace\n", progname);
+	exit(1);
+}
+
+/*
+ * Parse "mhz:mv,mhz:mv,..." (fastest first) into PERF_CTL values.
+ */
+static void
+parse_table(struct sim *s, const char *arg)
+{
+	const char		*p;
+	char			*end;
+	long			mhz, mv;
+
+	s->nstates = 0;
+	for (p = arg; *p != '\0'; p = end) {
+		if (*p == ',')
+			p++;
+		mhz = strtol(p, &end, 10);
+		if (*end != ':')
+			errx(1, "bad table entry at \"%s\"", p);
+		mv = strtol(end + 1, &end, 10);
+		if (mhz < 100 || mhz > 25500 || mv < 700 || mv > 700 + 16 * 63)
+			errx(1, "bad table entry %ld:%ld", mhz, mv);
+		if (s->nstates == MAXSTATES)
+			errx(1, "more than %d states", MAXSTATES);
+		s->table[s->nstates++] = (mhz / 100) << 8 | (mv - 700) / 16;
+	}
+	if (s->nstates < 2)
+		errx(1, "need at least two states");
+}
+
+/*
+ * Read the next interval of the trace into demand[], return the number
+ * of CPUs on the line, 0 at end of file.
+ */
+static int
+read_interval(FILE *fp, int *demand)
+{
+	char			line[1024], *p, *end;
+	long			v;
+	int			n;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		n = 0;
+		for (p = line; ; p = end) {
+			v = strtol(p, &end, 10);
+			if (end == p)
+				break;
+			if (v < 0 || v > 1000 || n == MAXCPUS)
+				errx(1, "bad trace line \"%s\"", line);
+			demand[n++] = v;
+		}
+		if (n > 0)
+			return n;
+	}
+	return 0;
+}
+
+static void
+run(struct sim *s, const struct policy *pol, FILE *fp, struct sim_result *r)
+{
+	int			demand[MAXCPUS];
+	uint64_t		work, served, power, fmax, mhz, mv0, mv;
+	uint16_t		halt;
+	int			c, n, i;
+
+	memset(r, 0, sizeof(*r));
+	s->state = 0;
+	s->credit = 0;
+	s->ncpu = 0;
+	memset(s->backlog, 0, sizeof(s->backlog));
+	fmax = MSR2MHZ(s->table[0], BUS_CLOCK);
+	mv0 = MSR2MV(s->table[0]);
+
+	while ((n = read_interval(fp, demand)) > 0) {
+		if (s->ncpu == 0)
+			s->ncpu = n;
+		else if (n != s->ncpu)
+			errx(1, "interval %d has %d CPUs, expected %d",
+			    r->intervals + 1, n, s->ncpu);
+
+		/* run the interval at the current state */
+		mhz = MSR2MHZ(s->table[s->state], BUS_CLOCK);
+		power = 0;
+		for (c = 0; c < s->ncpu; c++) {
+			work = demand[c] * fmax / 1000 + s->backlog[c];
+			served = work < mhz ? work : mhz;
+			s->backlog[c] = work - served;
+			if (s->backlog[c] > r->backlog_max)
+				r->backlog_max = s->backlog[c];
+			s->cur[c] = s->table[s->state];
+			s->util[c] = served * 1000 / mhz;
+			power += est_model_power_mw(s->ceff_pf, s->cur[c],
+			    BUS_CLOCK) * s->util[c] / 1000;
+
+			/* halted for the rest of the interval */
+			halt = (pol->flags & POL_RACE) ?
+			    s->table[s->nstates - 1] : s->cur[c];
+			mv = MSR2MV(halt);
+			power += s->idle_mw * mv * mv / (mv0 * mv0) *
+			    (1000 - s->util[c]) / 1000;
+		}
+		r->energy_uj += power * s->interval_ms;
+		if (s->budget != 0 && power > (uint64_t)s->budget)
+			r->over++;
+		r->intervals++;
+
+		if (s->verbose)
+			printf("%6d %5d MHz %6llu mW\n", r->intervals,
+			    (int)mhz, (unsigned long long)power);
+
+		/* sample and pick the state for the next interval */
+		if ((i = (*pol->select)(s)) >= 0)
+			s->state = i;
+	}
+	for (c = 0; c < s->ncpu; c++)
+		r->backlog_end += s->backlog[c];
+}
+
+/*
+ * Print the result of one policy, with its energy relative to ref if
+ * not NULL.  Return 2 if -x is set and a budget was missed, else 0.
+ */
+static int
+report(const struct sim *s, const struct policy *pol,
+    const struct sim_result *r, const struct sim_result *ref, int check)
+{
+	uint64_t		avg;
+	int64_t			diff;
+
+	avg = r->energy_uj / ((uint64_t)r->intervals * s->interval_ms);
+	printf("%-12s energy %llu mJ, average %llu mW, "
+	    "%d/%d intervals over budget, backlog max %llu end %llu",
+	    pol->name, (unsigned long long)r->energy_uj / 1000,
+	    (unsigned long long)avg, r->over, r->intervals,
+	    (unsigned long long)r->backlog_max,
+	    (unsigned long long)r->backlog_end);
+	if (ref != NULL && ref != r && ref->energy_uj != 0) {
+		/* tenths of a percent */
+		diff = ((int64_t)r->energy_uj - (int64_t)ref->energy_uj) *
+		    1000 / (int64_t)ref->energy_uj;
+		printf(", %c%lld.%lld%% vs %s", diff < 0 ? '-' : '+',
+		    (long long)(diff < 0 ? -diff : diff) / 10,
+		    (long long)(diff < 0 ? -diff : diff) % 10,
+		    policies[0].name);
+	}
+	printf("\n");
+
+	if (check && s->budget != 0 && (pol->flags & POL_BUDGET) &&
+	    avg * 100 > (uint64_t)s->budget * (100 + EST_SIM_SLACK)) {
+		fprintf(stderr, "%s: %s: average %llu mW over the %d mW "
+		    "budget\n", progname, pol->name, (unsigned long long)avg,
+		    s->budget);
+		return 2;
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sim		s;
+	struct sim_result	r[NPOLICIES];
+	const char		*pname;
+	FILE			*fp;
+	size_t			i, first, last;
+	int			ch, check, rv;
+
+	progname = argv[0];
+	check = 0;
+	memset(&s, 0, sizeof(s));
+	s.ceff_pf = 7000;
+	s.interval_ms = 250;
+	pname = "powerbudget";
+	/* Pentium M 755 */
+	parse_table(&s, "2000:1340,1800:1276,1600:1228,1400:1180,"
+	    "1200:1132,1000:1084,800:1036,600:988");
+
+	while ((ch = getopt(argc, argv, "b:c:f:i:p:t:vx")) != -1) {
+		switch (ch) {
+		case 'b':
+			s.budget = atoi(optarg);
+			break;
+		case 'c':
+			s.ceff_pf = strtoull(optarg, NULL, 10);
+			break;
+		case 'f':
+			parse_table(&s, optarg);
+			break;
+		case 'i':
+			s.idle_mw = strtoull(optarg, NULL, 10);
+			break;
+		case 'p':
+			pname = optarg;
+			break;
+		case 't':
+			s.interval_ms = atoi(optarg);
+			break;
+		case 'v':
+			s.verbose = 1;
+			break;
+		case 'x':
+			check = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 || s.interval_ms <= 0 || s.budget < 0)
+		usage();
+
+	if (strcmp(pname, "all") == 0) {
+		first = 0;
+		last = NPOLICIES - 1;
+	} else {
+		for (first = 0; first < NPOLICIES; first++)
+			if (strcmp(policies[first].name, pname) == 0)
+				break;
+		if (first == NPOLICIES)
+			errx(1, "unknown policy %s", pname);
+		last = first;
+	}
+
+	if ((fp = fopen(argv[0], "r")) == NULL)
+		err(1, "%s", argv[0]);
+	for (i = first; i <= last; i++) {
+		rewind(fp);
+		run(&s, &policies[i], fp, &r[i]);
+		if (r[i].intervals == 0)
+			errx(1, "%s: empty trace", argv[0]);
+	}
+	fclose(fp);
+
+	rv = 0;
+	for (i = first; i <= last; i++)
+		if (report(&s, &policies[i], &r[i],
+		    first == 0 && last > first ? &r[0] : NULL, check) != 0)
+			rv = 2;
+	return rv;
+}